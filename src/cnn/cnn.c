@@ -1,33 +1,64 @@
+#include <math.h>
 #include "img.h"
+#include "imgfam.h"
 #include "digits.h"
 #include "grid.h"
+#include "filter.h"
+#include "pool.h"
+#include "trace.h"
+#include "warp.h"
 
+/**
+ * @brief Number of pixels on each side of the cells given to the
+ *        digit layers.
+ */
+#define CNN_CELL_SIZE 28
+
+/**
+ * @brief Smallest side in pixels jpeg pictures are decoded at to
+ *        locate the grid, the cells are then read at the size of the
+ *        file.
+ */
+#define CNN_PREVIEW_SIZE 400
+
+/**
+ * @brief If not 0 the cells extracted by cnnExtractDigits are written
+ *        as extracted_digit_<column>_<row>.png in the current
+ *        directory. Set by the --cells option.
+ */
+int cnnWriteCells=0;
 
 /**
  * @brief Extract digits from a sudoku grid.
+ *
+ * The 81 cells are resampled in one pass by a map from the four
+ * corners of the grid, see newWarpCells, leaving 10 percent of each
+ * cell out on every side so that the lines of the grid are left out.
+ * The cells are written as png files when cnnWriteCells is set, and
+ * traced at level data.
  * @param myImg image from which we extract the digits.
- * @param xmin horizontal position of lower left corner of the sudoku grid.
- * @param ymin vertical position of lower left corner of the sudoku grid.
- * @param xmax horizontal position of upper right corner of the sudoku grid.
- * @param ymax vertical position of upper right corner of the sudoku grid.
+ * @param corners x and y of the top left, top right, bottom right and
+ *        bottom left corners of the grid in myImg.
+ * @return 81 cells of CNN_CELL_SIZE by CNN_CELL_SIZE pixels, row after
+ *         row of the grid, to be freed.
  */
-void cnnExtractDigits(Img*myImg,int xmin,int ymin,int xmax,int ymax) {
-    int xstep=(xmax-xmin)/9;
-    int ystep=(ymax-ymin)/9;
-    int tenPercent=xstep/10;
-    for (int i=0;i<9;++i) {
-        for (int j=0;j<9;++j) {
-            Img * aDigit = imgExtract(myImg,
-                                      xmin+i*xstep+tenPercent,
-                                      ymin+j*ystep+tenPercent,
-                                      xmin+(i+1)*xstep-tenPercent,
-                                      ymin+(j+1)*ystep-tenPercent);
-            char s [99];
-            snprintf(s,99,"extracted_digit_%d_%d.png",i,j);
-            imgWrite(aDigit,s);
-            deleteImg(aDigit);
+unsigned char * cnnExtractDigits(Img*myImg,const double*corners) {
+    int cellSize=CNN_CELL_SIZE*CNN_CELL_SIZE;
+    unsigned char * answer = (unsigned char*)malloc(81*cellSize);
+    Warp * warp = newWarpCells(myImg->width,myImg->height,corners,
+                               9,CNN_CELL_SIZE,0.1);
+    warpApply(warp,myImg,answer);
+    deleteWarp(warp);
+    for (int k=0;k<81;++k) {
+        Img cell = {CNN_CELL_SIZE,CNN_CELL_SIZE,answer+k*cellSize,NULL};
+        if (cnnWriteCells) {
+            char s[99];
+            snprintf(s,99,"extracted_digit_%d_%d.png",k%9,k/9);
+            imgWrite(&cell,s);
         }
+        TRACE_IMG(TRACE_DATA,&cell,"extracted_digit_%d_%d",k%9,k/9);
     }
+    return answer;
 }
 
 /** 
@@ -40,12 +71,29 @@ void usage(FILE*f,char*name) {
     fprintf(f,"This is %s version %s on archictecture %s.\n",
             bname, VERSION,CFG_UNAME);
     fprintf(f,"Usage:\n");
-    fprintf(f,"    %s <input-file> | <option> \n", bname);
+    fprintf(f,"    %s <input-file> [--exact] [--threads <n>]\n",bname);
+    fprintf(f,"        [--engine <filters|hough>] [--trace <level>] [--cells]\n");
+    fprintf(f,"        | <option> \n");
     fprintf(f,"Solves a Sudoku grid given a png or jpeg image as input.\n");
     fprintf(f,"\n");
     fprintf(f,"Where option is one of:\n");
     fprintf(f,"    [-h|--help] :\n");
     fprintf(f,"         Displays this help message and leaves.\n");
+    fprintf(f,"    --exact :\n");
+    fprintf(f,"         Never use the separable form of filters, convolutions\n");
+    fprintf(f,"         use every pixel of the filters.\n");
+    fprintf(f,"    --threads <n> :\n");
+    fprintf(f,"         Number of threads to use, by default the value of\n");
+    fprintf(f,"         CNN_THREADS or the number of processors.\n");
+    fprintf(f,"    --engine <filters|hough> :\n");
+    fprintf(f,"         How the lines of the grid are found: convolutions\n");
+    fprintf(f,"         with rotated bars (default) or Hough transform.\n");
+    fprintf(f,"    --trace <off|info|data|all> :\n");
+    fprintf(f,"         Level of the traces written, by default the value\n");
+    fprintf(f,"         of CNN_TRACE or off.\n");
+    fprintf(f,"    --cells :\n");
+    fprintf(f,"         Writes the 81 cells of the grid, 28 by 28 pixels, as\n");
+    fprintf(f,"         extracted_digit_<column>_<row>.png.\n");
     fprintf(f,"\n");
     fprintf(f,"%s comes with 3 friend tools:\n",bname);
     fprintf(f,"    img:\n");
@@ -79,48 +127,115 @@ int main (int argc,char**argv) {
             usage(stdout,argv[0]);
             exit(0);
         }
+        if (strcmp(argv[j],"--exact")==0) {
+            filterForceExact=1;
+        }
+        if (strcmp(argv[j],"--threads")==0 && j+1<argc) {
+            poolThreads=atoi(argv[++j]);
+        }
+        if (strcmp(argv[j],"--engine")==0 && j+1<argc) {
+            gridEngine=gridParseEngine(argv[++j]);
+        }
+        if (strcmp(argv[j],"--trace")==0 && j+1<argc) {
+            traceLevel=traceParseLevel(argv[++j]);
+        }
+        if (strcmp(argv[j],"--cells")==0) {
+            cnnWriteCells=1;
+        }
     }
     if(argc < 2) {
         usage(stderr,argv[0]);
         ERROR("At least 1 argument expected, the picture to read","");
     }
     /* read input image */
-    Img * rawInputImage=newImgRead(argv[1]);
+    // large jpeg photos are decoded at a smaller size to locate the
+    // grid. Png files are read at their size: the contrast is set
+    // before the pyramid is built, and set on a preview of averaged
+    // pixels it loses the grid of hard.png.
+    int scale;
+    int previewSize=
+        imgReadFormat(argv[1])==IMG_FORMAT_JPEG?CNN_PREVIEW_SIZE:0;
+    Img * rawInputImage=newImgReadScaled(argv[1],previewSize,&scale);
     Img * goodContastImage=imgLuminosityScale(rawInputImage);
     Img * inverseImage = imgInvert(goodContastImage);
     deleteImg(goodContastImage);
-    int scaleFactor=0;
-    while (inverseImage->width>400 && inverseImage->height>400) {
-        Img * i = imgDivideByTwo(inverseImage);
+    ImgFam * pyramid = newImgFamPyramid(inverseImage,1);
+    // rotate the picture once so that the grid lines are horizontal
+    // and vertical
+    double skew=gridEstimateSkew(pyramid);
+    if (skew!=0) {
+        Img * deskewed = imgRotateBilinear(inverseImage,skew,0);
         deleteImg(inverseImage);
-        inverseImage=i;
+        inverseImage=deskewed;
+        deleteImgFam(pyramid);
+        pyramid = newImgFamPyramid(inverseImage,1);
+    }
+    deleteImg(inverseImage);
+    // level of the pyramid with a side of at most 400 pixels
+    int scaleFactor=0;
+    while (scaleFactor+1<pyramid->count &&
+           pyramid->imgs[scaleFactor]->width>400 &&
+           pyramid->imgs[scaleFactor]->height>400) {
         scaleFactor++;
     }
+    inverseImage=pyramid->imgs[scaleFactor];
     int xmin,ymin,xmax,ymax;
-    // locate the grid
-    gridLocate(inverseImage,&xmin,&ymin,&xmax,&ymax);
+    // locate the grid, bounds are refined up to the original picture
+    if (gridLocatePyramid(pyramid,0,&xmin,&ymin,&xmax,&ymax))
+        ERROR("No sudoku grid found in picture: ",argv[1]);
     HERE("Found sudoku grid :");
-    printf("%d %d %d %d\n",xmin,ymin,xmax,ymax);
+    printf("%d %d %d %d\n",
+           xmin>>scaleFactor,ymin>>scaleFactor,
+           xmax>>scaleFactor,ymax>>scaleFactor);
 
-    imgDrawRect(inverseImage,xmin,ymin,xmax,ymax);
-    imgWrite(inverseImage,"afterstd.png");
-    // draw a square around the grid found in the
-    // original picture
-    imgDrawRect(rawInputImage,
-                xmin<<scaleFactor,
-                ymin<<scaleFactor,
-                xmax<<scaleFactor,
-                ymax<<scaleFactor);
+    if (TRACE_ON(TRACE_DATA)) {
+        imgDrawRect(inverseImage,
+                    xmin>>scaleFactor,ymin>>scaleFactor,
+                    xmax>>scaleFactor,ymax>>scaleFactor);
+        TRACE_IMG(TRACE_DATA,inverseImage,"afterstd");
+    }
+    // corners of the grid in the original picture, which is not
+    // deskewed
+    double corners[8]={xmin,ymin,xmax,ymin,xmax,ymax,xmin,ymax};
+    for (int i=0;i<4 && skew!=0;++i) {
+        double x=corners[2*i],y=corners[2*i+1];
+        imgRotateBilinearSource(rawInputImage->width,rawInputImage->height,
+                                skew,x,y,&corners[2*i],&corners[2*i+1]);
+    }
+    unsigned char * cells;
+    if (scale==1) {
+        cells = cnnExtractDigits(rawInputImage,corners);
+    } else {
+        // decode the part of the file under the grid at its size, a
+        // pixel of the preview is the average of scale by scale pixels
+        double full[8];
+        double x0=INFINITY,y0=INFINITY,x1=-INFINITY,y1=-INFINITY;
+        for (int i=0;i<4;++i) {
+            full[2*i]=(corners[2*i]+0.5)*scale-0.5;
+            full[2*i+1]=(corners[2*i+1]+0.5)*scale-0.5;
+            x0=fmin(x0,full[2*i]);
+            x1=fmax(x1,full[2*i]);
+            y0=fmin(y0,full[2*i+1]);
+            y1=fmax(y1,full[2*i+1]);
+        }
+        int left=(int)floor(x0)-1,top=(int)floor(y0)-1;
+        Img * region = newImgReadRegion(argv[1],&left,&top,
+                                        (int)ceil(x1)+2,(int)ceil(y1)+2);
+        for (int i=0;i<4;++i) {
+            full[2*i]-=left;
+            full[2*i+1]-=top;
+        }
+        cells = cnnExtractDigits(region,full);
+        deleteImg(region);
+    }
+    // draw the grid found in the original picture
+    imgDrawQuad(rawInputImage,corners);
     // write the image
     imgWrite(rawInputImage,"out.png");
     HERE("grid detection in out.png");
-    cnnExtractDigits(rawInputImage,
-                     xmin<<scaleFactor,
-                     ymin<<scaleFactor,
-                     xmax<<scaleFactor,
-                     ymax<<scaleFactor);
     // free allocated memory
-    deleteImg(inverseImage);
+    free(cells);
+    deleteImgFam(pyramid);
     deleteImg(rawInputImage);
     return 0;
 }
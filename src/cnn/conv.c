@@ -0,0 +1,1647 @@
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include "conv.h"
+#include "filter.h"
+#include "pool.h"
+#ifdef HAVE_CBLAS
+#include <cblas.h>
+#endif
+
+/**
+ * @file conv.c
+ * @brief Implements the convolution engine defined in conv.h.
+ *
+ * A convolution is computed one output row at a time. The row is cut
+ * in blocks of outputs kept in registers while the kernel adds, for
+ * every tap of the filter, the product of the tap with the pixels
+ * under it, so only the input window of a block is read. Pixels are
+ * unsigned char and taps are signed short, so two taps can be
+ * multiplied and added at once with the SSE2/AVX2 pmaddwd
+ * instruction. The kernel is selected at runtime given what the cpu
+ * supports. When the result has the size of the input, the input is
+ * surrounded once by zeros so that the kernel never tests bounds.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CONV_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Instruction set used by the engine, one of enum convIsa.
+ *
+ * When left to CONV_ISA_AUTO the environment variable CNN_CONV_ISA
+ * (scalar, sse2 or avx2) is looked at, then the cpu is queried.
+ */
+int convIsa=CONV_ISA_AUTO;
+
+/**
+ * @brief Use of the Fourier transform path: 0 lets convUseFft decide
+ *        with its cost model, a positive value forces it, a negative
+ *        value forbids it.
+ */
+int convFftMode=0;
+
+/**
+ * @brief Cost of n*log2(n) in a Fourier transform of n values compared
+ *        to a multiply-add of the direct kernel. Measured on AVX2, where
+ *        a dense 64x64 filter is still faster applied directly.
+ */
+#define CONV_FFT_COST 96
+
+/**
+ * @brief Use of the filter familly engine: 0 lets convUseGemm decide
+ *        with its cost model, a positive value forces it, a negative
+ *        value forbids it.
+ */
+int convGemmMode=0;
+
+/**
+ * @brief Cost in percent of a multiply-add of the filter familly
+ *        engine compared to one of the direct kernel.
+ */
+#define CONV_GEMM_COST 50
+
+/**
+ * @brief Computes one row of a convolution.
+ * @param src top left pixel of the input window of the first output.
+ * @param stride number of bytes between two rows of src.
+ * @param n number of outputs to compute.
+ * @param w the fw times fh taps of the filter.
+ * @param fw width of the filter.
+ * @param fh height of the filter.
+ * @param acc buffer of n integers where results are written.
+ */
+typedef void (*ConvRowKernel)(const unsigned char * src,
+                              int stride,
+                              int n,
+                              const short * w,
+                              int fw,
+                              int fh,
+                              int * acc);
+
+/**
+ * @brief Plain C version of the row kernel.
+ * @see ConvRowKernel
+ */
+static void convRowScalar(const unsigned char * src,
+                          int stride,
+                          int n,
+                          const short * w,
+                          int fw,
+                          int fh,
+                          int * acc)
+{
+    memset(acc,0,sizeof(int)*n);
+    for (int yy=0;yy<fh;++yy) {
+        const unsigned char * row = src+stride*yy;
+        for (int xx=0;xx<fw;++xx) {
+            int c=w[xx+fw*yy];
+            if (c==0) continue;
+            const unsigned char * p = row+xx;
+            for (int x=0;x<n;++x) {
+                acc[x]+=p[x]*c;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Adds c times a row of pixels to a row of floats,
+ *        used by the separable form of filters.
+ * @param dst n floats to update.
+ * @param src n pixels.
+ * @param c factor applied to pixels.
+ * @param n number of values.
+ */
+typedef void (*ConvAxpyByteKernel)(float * dst,
+                                   const unsigned char * src,
+                                   float c,
+                                   int n);
+
+/**
+ * @brief Adds c times a row of floats to a row of floats,
+ *        used by the separable form of filters.
+ * @param dst n floats to update.
+ * @param src n floats.
+ * @param c factor applied to src.
+ * @param n number of values.
+ */
+typedef void (*ConvAxpyKernel)(float * dst,
+                               const float * src,
+                               float c,
+                               int n);
+
+/**
+ * @brief Plain C version of ConvAxpyByteKernel.
+ */
+static void convAxpyByteScalar(float * dst,
+                               const unsigned char * src,
+                               float c,
+                               int n)
+{
+    for (int x=0;x<n;++x) {
+        dst[x]+=src[x]*c;
+    }
+}
+
+/**
+ * @brief Plain C version of ConvAxpyKernel.
+ */
+static void convAxpyScalar(float * dst,const float * src,float c,int n) {
+    for (int x=0;x<n;++x) {
+        dst[x]+=src[x]*c;
+    }
+}
+
+/**
+ * @brief Number of outputs of a row computed at once by the filter
+ *        familly engine (see convApplyFamily).
+ */
+#define CONV_GEMM_COLUMNS 64
+
+/**
+ * @brief Number of pairs of taps packed at once by the filter familly
+ *        engine, so that packed pixels stay in the level 1 cache.
+ */
+#define CONV_GEMM_PAIRS 128
+
+/**
+ * @brief Multiplies the weights of m filters by a tile of packed
+ *        pixels and adds the result to m rows of CONV_GEMM_COLUMNS
+ *        outputs.
+ * @param a weights of the filters, m rows of lda pairs of taps. A pair
+ *        is stored in an integer, first tap in the low 16 bits.
+ * @param lda number of pairs between two rows of a.
+ * @param m number of filters.
+ * @param b kp pairs of rows of CONV_GEMM_COLUMNS pixels. The two pixels
+ *        of a pair are stored next to each other, as shorts.
+ * @param kp number of pairs of taps.
+ * @param c m rows of CONV_GEMM_COLUMNS integers to update.
+ */
+typedef void (*ConvGemmKernel)(const int * a,
+                               int lda,
+                               int m,
+                               const short * b,
+                               int kp,
+                               int * c);
+
+/**
+ * @brief Copies pixels of two taps of a filter as a pair of rows
+ *        expected by ConvGemmKernel.
+ * @param p pixels seen by the first tap of the pair.
+ * @param q pixels seen by the second tap of the pair.
+ * @param n number of pixels to copy, the rest of the
+ *        CONV_GEMM_COLUMNS outputs are set to 0.
+ * @param dst 2*CONV_GEMM_COLUMNS shorts written.
+ */
+typedef void (*ConvPackKernel)(const unsigned char * p,
+                               const unsigned char * q,
+                               int n,
+                               short * dst);
+
+/**
+ * @brief Plain C version of ConvGemmKernel.
+ */
+static void convGemmScalar(const int * a,
+                           int lda,
+                           int m,
+                           const short * b,
+                           int kp,
+                           int * c)
+{
+    for (int i=0;i<m;++i) {
+        int * ci = c+CONV_GEMM_COLUMNS*i;
+        for (int k=0;k<kp;++k) {
+            unsigned int v=(unsigned int)a[lda*i+k];
+            int w0=(short)(v&0xffffu);
+            int w1=(short)(v>>16);
+            if (w0==0 && w1==0) continue;
+            const short * bk = b+2*CONV_GEMM_COLUMNS*k;
+            for (int x=0;x<CONV_GEMM_COLUMNS;++x) {
+                ci[x]+=bk[2*x]*w0+bk[2*x+1]*w1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Plain C version of ConvPackKernel.
+ */
+static void convPackScalar(const unsigned char * p,
+                           const unsigned char * q,
+                           int n,
+                           short * dst)
+{
+    for (int x=0;x<n;++x) {
+        dst[2*x]=p[x];
+        dst[2*x+1]=q[x];
+    }
+    memset(dst+2*n,0,sizeof(short)*2*(CONV_GEMM_COLUMNS-n));
+}
+
+#ifdef CONV_HAVE_X86
+/**
+ * @brief Lists the pairs of taps of a filter the vector row kernels
+ *        use. Taps are paired along rows, an odd last tap of a row is
+ *        paired with a null tap on the same pixels. Pairs of null taps
+ *        are skipped.
+ * @param stride number of bytes between two rows of the input.
+ * @param w the fw times fh taps of the filter.
+ * @param fw width of the filter.
+ * @param fh height of the filter.
+ * @param pairs where three integers per pair are written: the offset
+ *        in the input of the first tap, the offset of the second one
+ *        and both taps packed as two shorts. Room for fh*(fw+1)/2
+ *        pairs is needed.
+ * @return the number of pairs written.
+ */
+static int convListPairs(int stride,const short*w,int fw,int fh,int*pairs) {
+    int answer=0;
+    for (int yy=0;yy<fh;++yy) {
+        const short * wr = w+fw*yy;
+        for (int xx=0;xx<fw;xx+=2) {
+            int w0=wr[xx];
+            int w1=(xx+1<fw)?wr[xx+1]:0;
+            if (w0==0 && w1==0) continue;
+            pairs[3*answer]=xx+stride*yy;
+            pairs[3*answer+1]=(xx+1<fw)?xx+1+stride*yy:xx+stride*yy;
+            pairs[3*answer+2]=(int)((w0&0xffffu)|((w1&0xffffu)<<16));
+            answer++;
+        }
+    }
+    return answer;
+}
+
+/**
+ * @brief Computes outputs of a row of a convolution one by one, used
+ *        for the last outputs of the vector row kernels.
+ * @param src top left pixel of the input window of the first output.
+ * @param pairs pairs of taps listed by convListPairs.
+ * @param count number of pairs.
+ * @param x0 first output to compute.
+ * @param n number of outputs of the row.
+ * @param acc buffer of n integers where results are written.
+ */
+static void convRowTail(const unsigned char * src,
+                        const int * pairs,
+                        int count,
+                        int x0,
+                        int n,
+                        int * acc)
+{
+    for (int x=x0;x<n;++x) {
+        int v=0;
+        for (int k=0;k<count;++k) {
+            const int * pk = pairs+3*k;
+            v+=src[pk[0]+x]*(short)(pk[2]&0xffff)
+                +src[pk[1]+x]*(short)(pk[2]>>16);
+        }
+        acc[x]=v;
+    }
+}
+
+/**
+ * @brief SSE2 version of the row kernel.
+ *
+ * Outputs are computed by blocks of 16 kept in registers while all
+ * taps are added, so that only the input window of a block, a few
+ * kilobytes which stay in the level 1 cache, is read.
+ * @see ConvRowKernel
+ */
+__attribute__((target("sse2")))
+static void convRowSse2(const unsigned char * src,
+                        int stride,
+                        int n,
+                        const short * w,
+                        int fw,
+                        int fh,
+                        int * acc)
+{
+    int pairs[3*fh*((fw+1)/2)+1];
+    int count=convListPairs(stride,w,fw,fh,pairs);
+    __m128i zero=_mm_setzero_si128();
+    int x=0;
+    for (;x<n && n>=16;x+=16) {
+        // the last block overlaps the previous one rather than
+        // leaving outputs to convRowTail
+        if (x+16>n) x=n-16;
+        __m128i s0=zero,s1=zero,s2=zero,s3=zero;
+        for (int k=0;k<count;++k) {
+            const unsigned char * p = src+pairs[3*k]+x;
+            const unsigned char * q = src+pairs[3*k+1]+x;
+            __m128i wv=_mm_set1_epi32(pairs[3*k+2]);
+            __m128i a=_mm_loadu_si128((const __m128i*)p);
+            __m128i b=_mm_loadu_si128((const __m128i*)q);
+            __m128i al=_mm_unpacklo_epi8(a,zero);
+            __m128i bl=_mm_unpacklo_epi8(b,zero);
+            __m128i ah=_mm_unpackhi_epi8(a,zero);
+            __m128i bh=_mm_unpackhi_epi8(b,zero);
+            s0=_mm_add_epi32(s0,_mm_madd_epi16(_mm_unpacklo_epi16(al,bl),wv));
+            s1=_mm_add_epi32(s1,_mm_madd_epi16(_mm_unpackhi_epi16(al,bl),wv));
+            s2=_mm_add_epi32(s2,_mm_madd_epi16(_mm_unpacklo_epi16(ah,bh),wv));
+            s3=_mm_add_epi32(s3,_mm_madd_epi16(_mm_unpackhi_epi16(ah,bh),wv));
+        }
+        __m128i * o=(__m128i*)(acc+x);
+        _mm_storeu_si128(o,s0);
+        _mm_storeu_si128(o+1,s1);
+        _mm_storeu_si128(o+2,s2);
+        _mm_storeu_si128(o+3,s3);
+    }
+    convRowTail(src,pairs,count,x,n,acc);
+}
+
+/**
+ * @brief AVX2 version of the row kernel, same as the SSE2 one with
+ *        blocks of 32 outputs.
+ * @see ConvRowKernel
+ */
+__attribute__((target("avx2")))
+static void convRowAvx2(const unsigned char * src,
+                        int stride,
+                        int n,
+                        const short * w,
+                        int fw,
+                        int fh,
+                        int * acc)
+{
+    if (n<32) {
+        convRowSse2(src,stride,n,w,fw,fh,acc);
+        return;
+    }
+    int pairs[3*fh*((fw+1)/2)+1];
+    int count=convListPairs(stride,w,fw,fh,pairs);
+    for (int x=0;x<n;x+=32) {
+        if (x+32>n) x=n-32;
+        __m256i s0=_mm256_setzero_si256(),s1=s0,s2=s0,s3=s0;
+        for (int k=0;k<count;++k) {
+            const unsigned char * p = src+pairs[3*k]+x;
+            const unsigned char * q = src+pairs[3*k+1]+x;
+            __m256i wv=_mm256_set1_epi32(pairs[3*k+2]);
+            __m256i a0=_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+            __m256i b0=_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)q));
+            __m256i a1=_mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(p+16)));
+            __m256i b1=_mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(q+16)));
+            s0=_mm256_add_epi32(s0,
+                _mm256_madd_epi16(_mm256_unpacklo_epi16(a0,b0),wv));
+            s1=_mm256_add_epi32(s1,
+                _mm256_madd_epi16(_mm256_unpackhi_epi16(a0,b0),wv));
+            s2=_mm256_add_epi32(s2,
+                _mm256_madd_epi16(_mm256_unpacklo_epi16(a1,b1),wv));
+            s3=_mm256_add_epi32(s3,
+                _mm256_madd_epi16(_mm256_unpackhi_epi16(a1,b1),wv));
+        }
+        // unpack works within 128 bits lanes: s0 holds outputs 0-3 and
+        // 8-11, s1 holds outputs 4-7 and 12-15.
+        __m256i * o=(__m256i*)(acc+x);
+        _mm256_storeu_si256(o,_mm256_permute2x128_si256(s0,s1,0x20));
+        _mm256_storeu_si256(o+1,_mm256_permute2x128_si256(s0,s1,0x31));
+        _mm256_storeu_si256(o+2,_mm256_permute2x128_si256(s2,s3,0x20));
+        _mm256_storeu_si256(o+3,_mm256_permute2x128_si256(s2,s3,0x31));
+    }
+}
+
+/**
+ * @brief SSE2 version of ConvAxpyByteKernel.
+ */
+__attribute__((target("sse2")))
+static void convAxpyByteSse2(float * dst,
+                             const unsigned char * src,
+                             float c,
+                             int n)
+{
+    int nv=n&~7;
+    __m128i zero=_mm_setzero_si128();
+    __m128 cv=_mm_set1_ps(c);
+    for (int x=0;x<nv;x+=8) {
+        __m128i a=_mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(src+x)),zero);
+        __m128 lo=_mm_cvtepi32_ps(_mm_unpacklo_epi16(a,zero));
+        __m128 hi=_mm_cvtepi32_ps(_mm_unpackhi_epi16(a,zero));
+        _mm_storeu_ps(dst+x,_mm_add_ps(_mm_loadu_ps(dst+x),
+                                       _mm_mul_ps(lo,cv)));
+        _mm_storeu_ps(dst+x+4,_mm_add_ps(_mm_loadu_ps(dst+x+4),
+                                         _mm_mul_ps(hi,cv)));
+    }
+    convAxpyByteScalar(dst+nv,src+nv,c,n-nv);
+}
+
+/**
+ * @brief SSE2 version of ConvAxpyKernel.
+ */
+__attribute__((target("sse2")))
+static void convAxpySse2(float * dst,const float * src,float c,int n) {
+    int nv=n&~3;
+    __m128 cv=_mm_set1_ps(c);
+    for (int x=0;x<nv;x+=4) {
+        _mm_storeu_ps(dst+x,_mm_add_ps(_mm_loadu_ps(dst+x),
+                                       _mm_mul_ps(_mm_loadu_ps(src+x),cv)));
+    }
+    convAxpyScalar(dst+nv,src+nv,c,n-nv);
+}
+
+/**
+ * @brief AVX2 version of ConvAxpyByteKernel.
+ */
+__attribute__((target("avx2")))
+static void convAxpyByteAvx2(float * dst,
+                             const unsigned char * src,
+                             float c,
+                             int n)
+{
+    int nv=n&~7;
+    __m256 cv=_mm256_set1_ps(c);
+    for (int x=0;x<nv;x+=8) {
+        __m256 a=_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i*)(src+x))));
+        _mm256_storeu_ps(dst+x,_mm256_add_ps(_mm256_loadu_ps(dst+x),
+                                             _mm256_mul_ps(a,cv)));
+    }
+    convAxpyByteScalar(dst+nv,src+nv,c,n-nv);
+}
+
+/**
+ * @brief AVX2 version of ConvAxpyKernel.
+ */
+__attribute__((target("avx2")))
+static void convAxpyAvx2(float * dst,const float * src,float c,int n) {
+    int nv=n&~7;
+    __m256 cv=_mm256_set1_ps(c);
+    for (int x=0;x<nv;x+=8) {
+        _mm256_storeu_ps(dst+x,
+            _mm256_add_ps(_mm256_loadu_ps(dst+x),
+                          _mm256_mul_ps(_mm256_loadu_ps(src+x),cv)));
+    }
+    convAxpyScalar(dst+nv,src+nv,c,n-nv);
+}
+
+/**
+ * @brief SSE2 version of ConvPackKernel.
+ */
+__attribute__((target("sse2")))
+static void convPackSse2(const unsigned char * p,
+                         const unsigned char * q,
+                         int n,
+                         short * dst)
+{
+    int nv=n&~15;
+    __m128i zero=_mm_setzero_si128();
+    for (int x=0;x<nv;x+=16) {
+        __m128i a=_mm_loadu_si128((const __m128i*)(p+x));
+        __m128i b=_mm_loadu_si128((const __m128i*)(q+x));
+        __m128i lo=_mm_unpacklo_epi8(a,b);
+        __m128i hi=_mm_unpackhi_epi8(a,b);
+        __m128i * o=(__m128i*)(dst+2*x);
+        _mm_storeu_si128(o,_mm_unpacklo_epi8(lo,zero));
+        _mm_storeu_si128(o+1,_mm_unpackhi_epi8(lo,zero));
+        _mm_storeu_si128(o+2,_mm_unpacklo_epi8(hi,zero));
+        _mm_storeu_si128(o+3,_mm_unpackhi_epi8(hi,zero));
+    }
+    for (int x=nv;x<n;++x) {
+        dst[2*x]=p[x];
+        dst[2*x+1]=q[x];
+    }
+    memset(dst+2*n,0,sizeof(short)*2*(CONV_GEMM_COLUMNS-n));
+}
+
+/**
+ * @brief SSE2 version of ConvGemmKernel, 4 filters by 8 outputs at a
+ *        time.
+ */
+__attribute__((target("sse2")))
+static void convGemmSse2(const int * a,
+                         int lda,
+                         int m,
+                         const short * b,
+                         int kp,
+                         int * c)
+{
+    int i=0;
+    for (;i+4<=m;i+=4) {
+        const int * a0=a+lda*i;
+        const int * a1=a0+lda;
+        const int * a2=a1+lda;
+        const int * a3=a2+lda;
+        for (int x=0;x<CONV_GEMM_COLUMNS;x+=8) {
+            __m128i * c0=(__m128i*)(c+CONV_GEMM_COLUMNS*i+x);
+            __m128i * c1=c0+CONV_GEMM_COLUMNS/4;
+            __m128i * c2=c1+CONV_GEMM_COLUMNS/4;
+            __m128i * c3=c2+CONV_GEMM_COLUMNS/4;
+            __m128i s00=_mm_loadu_si128(c0),s01=_mm_loadu_si128(c0+1);
+            __m128i s10=_mm_loadu_si128(c1),s11=_mm_loadu_si128(c1+1);
+            __m128i s20=_mm_loadu_si128(c2),s21=_mm_loadu_si128(c2+1);
+            __m128i s30=_mm_loadu_si128(c3),s31=_mm_loadu_si128(c3+1);
+            for (int k=0;k<kp;++k) {
+                const __m128i * bk=
+                    (const __m128i*)(b+2*(CONV_GEMM_COLUMNS*k+x));
+                __m128i b0=_mm_loadu_si128(bk);
+                __m128i b1=_mm_loadu_si128(bk+1);
+                __m128i w=_mm_set1_epi32(a0[k]);
+                s00=_mm_add_epi32(s00,_mm_madd_epi16(b0,w));
+                s01=_mm_add_epi32(s01,_mm_madd_epi16(b1,w));
+                w=_mm_set1_epi32(a1[k]);
+                s10=_mm_add_epi32(s10,_mm_madd_epi16(b0,w));
+                s11=_mm_add_epi32(s11,_mm_madd_epi16(b1,w));
+                w=_mm_set1_epi32(a2[k]);
+                s20=_mm_add_epi32(s20,_mm_madd_epi16(b0,w));
+                s21=_mm_add_epi32(s21,_mm_madd_epi16(b1,w));
+                w=_mm_set1_epi32(a3[k]);
+                s30=_mm_add_epi32(s30,_mm_madd_epi16(b0,w));
+                s31=_mm_add_epi32(s31,_mm_madd_epi16(b1,w));
+            }
+            _mm_storeu_si128(c0,s00);_mm_storeu_si128(c0+1,s01);
+            _mm_storeu_si128(c1,s10);_mm_storeu_si128(c1+1,s11);
+            _mm_storeu_si128(c2,s20);_mm_storeu_si128(c2+1,s21);
+            _mm_storeu_si128(c3,s30);_mm_storeu_si128(c3+1,s31);
+        }
+    }
+    // remaining filters one at a time, 16 outputs at a time
+    for (;i<m;++i) {
+        const int * ai=a+lda*i;
+        for (int x=0;x<CONV_GEMM_COLUMNS;x+=16) {
+            __m128i * ci=(__m128i*)(c+CONV_GEMM_COLUMNS*i+x);
+            __m128i s0=_mm_loadu_si128(ci),s1=_mm_loadu_si128(ci+1);
+            __m128i s2=_mm_loadu_si128(ci+2),s3=_mm_loadu_si128(ci+3);
+            for (int k=0;k<kp;++k) {
+                const __m128i * bk=
+                    (const __m128i*)(b+2*(CONV_GEMM_COLUMNS*k+x));
+                __m128i w=_mm_set1_epi32(ai[k]);
+                s0=_mm_add_epi32(s0,_mm_madd_epi16(_mm_loadu_si128(bk),w));
+                s1=_mm_add_epi32(s1,_mm_madd_epi16(_mm_loadu_si128(bk+1),w));
+                s2=_mm_add_epi32(s2,_mm_madd_epi16(_mm_loadu_si128(bk+2),w));
+                s3=_mm_add_epi32(s3,_mm_madd_epi16(_mm_loadu_si128(bk+3),w));
+            }
+            _mm_storeu_si128(ci,s0);_mm_storeu_si128(ci+1,s1);
+            _mm_storeu_si128(ci+2,s2);_mm_storeu_si128(ci+3,s3);
+        }
+    }
+}
+
+/**
+ * @brief AVX2 version of ConvGemmKernel, 4 filters by 16 outputs at a
+ *        time.
+ */
+__attribute__((target("avx2")))
+static void convGemmAvx2(const int * a,
+                         int lda,
+                         int m,
+                         const short * b,
+                         int kp,
+                         int * c)
+{
+    int i=0;
+    for (;i+4<=m;i+=4) {
+        const int * a0=a+lda*i;
+        const int * a1=a0+lda;
+        const int * a2=a1+lda;
+        const int * a3=a2+lda;
+        for (int x=0;x<CONV_GEMM_COLUMNS;x+=16) {
+            __m256i * c0=(__m256i*)(c+CONV_GEMM_COLUMNS*i+x);
+            __m256i * c1=c0+CONV_GEMM_COLUMNS/8;
+            __m256i * c2=c1+CONV_GEMM_COLUMNS/8;
+            __m256i * c3=c2+CONV_GEMM_COLUMNS/8;
+            __m256i s00=_mm256_loadu_si256(c0),s01=_mm256_loadu_si256(c0+1);
+            __m256i s10=_mm256_loadu_si256(c1),s11=_mm256_loadu_si256(c1+1);
+            __m256i s20=_mm256_loadu_si256(c2),s21=_mm256_loadu_si256(c2+1);
+            __m256i s30=_mm256_loadu_si256(c3),s31=_mm256_loadu_si256(c3+1);
+            for (int k=0;k<kp;++k) {
+                const __m256i * bk=
+                    (const __m256i*)(b+2*(CONV_GEMM_COLUMNS*k+x));
+                __m256i b0=_mm256_loadu_si256(bk);
+                __m256i b1=_mm256_loadu_si256(bk+1);
+                __m256i w=_mm256_set1_epi32(a0[k]);
+                s00=_mm256_add_epi32(s00,_mm256_madd_epi16(b0,w));
+                s01=_mm256_add_epi32(s01,_mm256_madd_epi16(b1,w));
+                w=_mm256_set1_epi32(a1[k]);
+                s10=_mm256_add_epi32(s10,_mm256_madd_epi16(b0,w));
+                s11=_mm256_add_epi32(s11,_mm256_madd_epi16(b1,w));
+                w=_mm256_set1_epi32(a2[k]);
+                s20=_mm256_add_epi32(s20,_mm256_madd_epi16(b0,w));
+                s21=_mm256_add_epi32(s21,_mm256_madd_epi16(b1,w));
+                w=_mm256_set1_epi32(a3[k]);
+                s30=_mm256_add_epi32(s30,_mm256_madd_epi16(b0,w));
+                s31=_mm256_add_epi32(s31,_mm256_madd_epi16(b1,w));
+            }
+            _mm256_storeu_si256(c0,s00);_mm256_storeu_si256(c0+1,s01);
+            _mm256_storeu_si256(c1,s10);_mm256_storeu_si256(c1+1,s11);
+            _mm256_storeu_si256(c2,s20);_mm256_storeu_si256(c2+1,s21);
+            _mm256_storeu_si256(c3,s30);_mm256_storeu_si256(c3+1,s31);
+        }
+    }
+    // remaining filters one at a time, 32 outputs at a time
+    for (;i<m;++i) {
+        const int * ai=a+lda*i;
+        for (int x=0;x<CONV_GEMM_COLUMNS;x+=32) {
+            __m256i * ci=(__m256i*)(c+CONV_GEMM_COLUMNS*i+x);
+            __m256i s0=_mm256_loadu_si256(ci),s1=_mm256_loadu_si256(ci+1);
+            __m256i s2=_mm256_loadu_si256(ci+2),s3=_mm256_loadu_si256(ci+3);
+            for (int k=0;k<kp;++k) {
+                const __m256i * bk=
+                    (const __m256i*)(b+2*(CONV_GEMM_COLUMNS*k+x));
+                __m256i w=_mm256_set1_epi32(ai[k]);
+                s0=_mm256_add_epi32(s0,_mm256_madd_epi16(
+                                       _mm256_loadu_si256(bk),w));
+                s1=_mm256_add_epi32(s1,_mm256_madd_epi16(
+                                       _mm256_loadu_si256(bk+1),w));
+                s2=_mm256_add_epi32(s2,_mm256_madd_epi16(
+                                       _mm256_loadu_si256(bk+2),w));
+                s3=_mm256_add_epi32(s3,_mm256_madd_epi16(
+                                       _mm256_loadu_si256(bk+3),w));
+            }
+            _mm256_storeu_si256(ci,s0);_mm256_storeu_si256(ci+1,s1);
+            _mm256_storeu_si256(ci+2,s2);_mm256_storeu_si256(ci+3,s3);
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Gives the name of an instruction set.
+ * @param isa one of enum convIsa.
+ * @return a static string.
+ */
+const char * convIsaName(int isa) {
+    switch (isa) {
+    case CONV_ISA_SCALAR: return "scalar";
+    case CONV_ISA_SSE2: return "sse2";
+    case CONV_ISA_AVX2: return "avx2";
+    }
+    return "auto";
+}
+
+/**
+ * @brief Tells which instruction set the engine runs on.
+ *
+ * The first call resolves CONV_ISA_AUTO and stores the answer in
+ * convIsa. A value not supported by the cpu is lowered. Can be called
+ * from several threads at the same time.
+ * @return one of CONV_ISA_SCALAR, CONV_ISA_SSE2 or CONV_ISA_AVX2.
+ */
+int convGetIsa() {
+    static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+    int best=CONV_ISA_SCALAR;
+#ifdef CONV_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) best=CONV_ISA_SSE2;
+    if (__builtin_cpu_supports("avx2")) best=CONV_ISA_AVX2;
+#endif
+    pthread_mutex_lock(&lock);
+    if (convIsa==CONV_ISA_AUTO) {
+        convIsa=best;
+        char * e = getenv("CNN_CONV_ISA");
+        if (e!=NULL) {
+            if (strcmp(e,"scalar")==0) convIsa=CONV_ISA_SCALAR;
+            else if (strcmp(e,"sse2")==0) convIsa=CONV_ISA_SSE2;
+            else if (strcmp(e,"avx2")==0) convIsa=CONV_ISA_AVX2;
+            else WARNING("unknown value for CNN_CONV_ISA: ",e);
+        }
+    }
+    if (convIsa>best) convIsa=best;
+    int answer=convIsa;
+    pthread_mutex_unlock(&lock);
+    return answer;
+}
+
+/**
+ * @brief Gets the row kernel for the current instruction set.
+ * @return a function pointer.
+ */
+static ConvRowKernel convGetRowKernel() {
+    switch (convGetIsa()) {
+#ifdef CONV_HAVE_X86
+    case CONV_ISA_AVX2: return convRowAvx2;
+    case CONV_ISA_SSE2: return convRowSse2;
+#endif
+    }
+    return convRowScalar;
+}
+
+/**
+ * @brief Maps the raw result of a convolution to a grey level using
+ *        the threshold and maximum value of the filter.
+ *
+ * The division by maxVal-threshold is done by a multiplication by its
+ * fixed point reciprocal when the filter has one, which gives the
+ * same result.
+ * @param f the filter used.
+ * @param v raw value of the convolution.
+ * @return the grey level.
+ */
+static unsigned char convRescale(Filter*f,long int v) {
+    if (v<f->threshold) return 0;
+    if (v>f->maxVal) return 255;
+    if (f->rescaleMul)
+        return (255ULL*(v-f->threshold)*f->rescaleMul)>>f->rescaleShift;
+    return (255*(v-f->threshold))/(f->maxVal-f->threshold);
+}
+
+/**
+ * @brief Surrounds an image with a border of zeros so that a filter
+ *        can be centered on any of its pixels.
+ * @param in the input picture.
+ * @param fw width of the filter.
+ * @param fh height of the filter.
+ * @return a newly allocated picture of in->width+fw-1 by in->height+fh-1
+ *         pixels.
+ */
+static Img * convPad(Img*in,int fw,int fh) {
+    Img * answer=newImgColor(in->width+fw-1,in->height+fh-1,0);
+    for (int y=0;y<in->height;++y) {
+        memcpy(&answer->data[fw/2+answer->width*(y+fh/2)],
+               &in->data[in->width*y],
+               in->width);
+    }
+    return answer;
+}
+
+/**
+ * @brief perform a convolution between an image and a filter.
+ *
+ * Pixels outside of the input image count as 0. Resulting values
+ * are the same as the ones computed pixel by pixel with imgGetVal.
+ * @param in the input picture.
+ * @param filter the filter to use.
+ * @param diff if not zero 128 is substracted to each pixel of the filter.
+ * @param sameSize if zero the result size is
+ *        in->width-filter->img->width+1 by
+ *        in->height-filter->img->height+1, otherwise the result has the
+ *        size of in and the filter is centered on each pixel.
+ * @return the newly allocated picture with represents the convolution.
+ */
+Img * convApply(Img*in,Filter*filter,int diff,int sameSize) {
+    int fw=filter->img->width;
+    int fh=filter->img->height;
+    const short * w = filterGetTaps(filter,diff);
+    long int bound=filter->tapBound[diff?1:0];
+    Img * src = sameSize?convPad(in,fw,fh):in;
+    int aw=src->width-fw+1;
+    int ah=src->height-fh+1;
+    Img * answer = newImgColor(aw,ah,0);
+    if (bound<=INT_MAX) {
+        ConvRowKernel kernel=convGetRowKernel();
+        int * acc = (int*)malloc(sizeof(int)*aw);
+        for (int y=0;y<ah;++y) {
+            kernel(&src->data[src->width*y],src->width,aw,w,fw,fh,acc);
+            for (int x=0;x<aw;++x) {
+                answer->data[x+aw*y]=convRescale(filter,acc[x]);
+            }
+        }
+        free(acc);
+    } else {
+        // an integer could overflow, stick to long integers
+        for (int y=0;y<ah;++y) {
+            for (int x=0;x<aw;++x) {
+                long int v=0;
+                for (int yy=0;yy<fh;++yy) {
+                    const unsigned char * p =
+                        &src->data[x+src->width*(y+yy)];
+                    for (int xx=0;xx<fw;++xx) {
+                        v+=p[xx]*w[xx+fw*yy];
+                    }
+                }
+                answer->data[x+aw*y]=convRescale(filter,v);
+            }
+        }
+    }
+    if (src!=in)
+        deleteImg(src);
+    return answer;
+}
+
+/**
+ * @brief perform a convolution followed by a max pooling, without
+ *        storing the result of the convolution.
+ *
+ * Rows of the convolution are computed by the row kernel in a circular
+ * buffer of poolsize rows, and only the maximum of each pooling window
+ * is rescaled and written. The threshold and maximum value of the
+ * filter are applied by a non decreasing function, so results are the
+ * same as imgDownSampleMax on the result of convApply.
+ * @param in the input picture.
+ * @param filter the filter to use.
+ * @param diff same meaning as in convApply.
+ * @param sameSize same meaning as in convApply.
+ * @param poolsize size of the square on which the maximum is computed.
+ * @param stride number of pixels between two squares.
+ * @return the newly allocated pooled picture.
+ */
+Img * convApplyMaxPool(Img*in,
+                       Filter*filter,
+                       int diff,
+                       int sameSize,
+                       int poolsize,
+                       int stride)
+{
+    int fw=filter->img->width;
+    int fh=filter->img->height;
+    const short * w = filterGetTaps(filter,diff);
+    long int bound=filter->tapBound[diff?1:0];
+    if (bound>INT_MAX) {
+        Img * c = convApply(in,filter,diff,sameSize);
+        Img * answer = imgDownSampleMax(c,poolsize,stride);
+        deleteImg(c);
+        return answer;
+    }
+    Img * src = sameSize?convPad(in,fw,fh):in;
+    int aw=src->width-fw+1;
+    int ah=src->height-fh+1;
+    if (aw<poolsize || ah<poolsize)
+        ERROR("Wrong size, poolsize too large.","");
+    int pw=(aw-poolsize)/stride+1;
+    int ph=(ah-poolsize)/stride+1;
+    Img * answer = newImgColor(pw,ph,0);
+    ConvRowKernel kernel=convGetRowKernel();
+    // row y of the convolution is stored at rows[aw*(y%poolsize)]
+    int * rows = (int*)malloc(sizeof(int)*aw*poolsize);
+    int * colMax = (int*)malloc(sizeof(int)*aw);
+    int next=0;
+    for (int py=0;py<ph;++py) {
+        int y0=py*stride;
+        // rows between two windows are not needed when stride>poolsize
+        if (next<y0) next=y0;
+        for (;next<y0+poolsize;++next) {
+            kernel(&src->data[src->width*next],src->width,aw,w,fw,fh,
+                   &rows[aw*(next%poolsize)]);
+        }
+        memcpy(colMax,&rows[aw*(y0%poolsize)],sizeof(int)*aw);
+        for (int yy=1;yy<poolsize;++yy) {
+            const int * r = &rows[aw*((y0+yy)%poolsize)];
+            for (int x=0;x<aw;++x) {
+                if (r[x]>colMax[x]) colMax[x]=r[x];
+            }
+        }
+        for (int px=0;px<pw;++px) {
+            const int * c = &colMax[px*stride];
+            int max=c[0];
+            for (int xx=1;xx<poolsize;++xx) {
+                if (c[xx]>max) max=c[xx];
+            }
+            answer->data[px+pw*py]=convRescale(filter,max);
+        }
+    }
+    free(colMax);
+    free(rows);
+    if (src!=in)
+        deleteImg(src);
+    return answer;
+}
+
+/**
+ * @brief perform a convolution between an image and the separable
+ *        form of a filter.
+ *
+ * Each of the filter->sepRank terms is applied as a horizontal pass
+ * followed by a vertical pass, so a pixel costs
+ * sepRank*(width+height) operations instead of width*height.
+ * As with convApply with diff set, 128 is substracted to each pixel of
+ * the filter. Unless the separable form is exact results are an
+ * approximation of the ones of convApply.
+ * @param in the input picture.
+ * @param filter the filter to use, filter->sepRank should not be 0.
+ * @param sameSize same meaning as in convApply.
+ * @return the newly allocated picture with represents the convolution.
+ * @see filterUpdateSeparable
+ */
+Img * convApplySeparable(Img*in,Filter*filter,int sameSize) {
+    int fw=filter->img->width;
+    int fh=filter->img->height;
+    if (filter->sepRank<1)
+        ERROR("Filter has no separable form.","");
+    Img * src = sameSize?convPad(in,fw,fh):in;
+    int aw=src->width-fw+1;
+    int ah=src->height-fh+1;
+    float * tmp = (float*)malloc(sizeof(float)*aw*src->height);
+    float * acc = (float*)malloc(sizeof(float)*aw*ah);
+    memset(acc,0,sizeof(float)*aw*ah);
+    ConvAxpyByteKernel axpyByte=convAxpyByteScalar;
+    ConvAxpyKernel axpy=convAxpyScalar;
+    switch (convGetIsa()) {
+#ifdef CONV_HAVE_X86
+    case CONV_ISA_AVX2:
+        axpyByte=convAxpyByteAvx2;
+        axpy=convAxpyAvx2;
+        break;
+    case CONV_ISA_SSE2:
+        axpyByte=convAxpyByteSse2;
+        axpy=convAxpySse2;
+        break;
+#endif
+    }
+    for (int r=0;r<filter->sepRank;++r) {
+        const float * row = &filter->sepRow[fw*r];
+        const float * col = &filter->sepCol[fh*r];
+        // horizontal pass on all rows of the source
+        memset(tmp,0,sizeof(float)*aw*src->height);
+        for (int y=0;y<src->height;++y) {
+            for (int xx=0;xx<fw;++xx) {
+                if (row[xx]!=0)
+                    axpyByte(&tmp[aw*y],&src->data[xx+src->width*y],
+                             row[xx],aw);
+            }
+        }
+        // vertical pass
+        for (int y=0;y<ah;++y) {
+            for (int yy=0;yy<fh;++yy) {
+                if (col[yy]!=0)
+                    axpy(&acc[aw*y],&tmp[aw*(y+yy)],col[yy],aw);
+            }
+        }
+    }
+    Img * answer = newImgColor(aw,ah,0);
+    for (int i=0;i<aw*ah;++i) {
+        answer->data[i]=convRescale(filter,lroundf(acc[i]));
+    }
+    free(acc);
+    free(tmp);
+    if (src!=in)
+        deleteImg(src);
+    return answer;
+}
+
+/**
+ * @brief Tells if convolutions of an image by filters should go
+ *        through the Fourier transform.
+ *
+ * The cost of the direct kernel is one multiply-add per non null tap
+ * and per output. The cost of the Fourier transform path is the
+ * transform of the image, shared by the count filters, plus one
+ * transform for the filters and one inverse transform for every two
+ * filters. A transform of n values costs CONV_FFT_COST*n*log2(n)
+ * multiply-adds of the direct kernel.
+ * @param w width of the image.
+ * @param h height of the image.
+ * @param filter one of the filters, all of them have the same size.
+ * @param diff same meaning as in convApply.
+ * @param sameSize same meaning as in convApply.
+ * @param count number of filters applied to the same image.
+ * @return non zero if newConvSpectrum and convApplySpectrum should be used.
+ */
+int convUseFft(int w,int h,Filter*filter,int diff,int sameSize,int count) {
+    if (convFftMode) return convFftMode>0;
+    int fw=filter->img->width;
+    int fh=filter->img->height;
+    int sw=sameSize?w+fw-1:w;
+    int sh=sameSize?h+fh-1:h;
+    double outputs=(double)(sw-fw+1)*(sh-fh+1);
+    double direct=outputs*filter->tapCount[diff?1:0]*count;
+    double n=(double)fftGoodSize(sw)*fftGoodSize(sh);
+    double fft=CONV_FFT_COST*n*log2(n)*(1+2*((count+1)/2));
+    return fft<direct;
+}
+
+/**
+ * @brief Computes the Fourier transform of an image.
+ * @param in the input picture.
+ * @param fw width of the filters to apply.
+ * @param fh height of the filters to apply.
+ * @param sameSize same meaning as in convApply.
+ * @return the newly allocated spectrum, to be freed with
+ *         deleteConvSpectrum.
+ * @see convApplySpectrum
+ */
+ConvSpectrum * newConvSpectrum(Img*in,int fw,int fh,int sameSize) {
+    ConvSpectrum * answer = (ConvSpectrum*)malloc(sizeof(struct convSpectrum));
+    Img * src = sameSize?convPad(in,fw,fh):in;
+    answer->width=src->width;
+    answer->height=src->height;
+    answer->fw=fw;
+    answer->fh=fh;
+    answer->sameSize=sameSize;
+    // values outside of the source are never read by outputs
+    // which are kept, no need of extra padding.
+    answer->rowPlan=newFftPlan(fftGoodSize(src->width));
+    answer->colPlan=newFftPlan(fftGoodSize(src->height));
+    int n=answer->rowPlan->n;
+    int m=answer->colPlan->n;
+    answer->data=(double*)malloc(sizeof(double)*2*n*m);
+    memset(answer->data,0,sizeof(double)*2*n*m);
+    for (int y=0;y<src->height;++y) {
+        for (int x=0;x<src->width;++x) {
+            answer->data[2*(x+n*y)]=src->data[x+src->width*y];
+        }
+    }
+    fft2d(answer->rowPlan,answer->colPlan,answer->data,0,src->height);
+    if (src!=in)
+        deleteImg(src);
+    return answer;
+}
+
+/**
+ * @brief Releases memory allocated for a spectrum.
+ * @param s the spectrum to free. Nothing happens if s is NULL.
+ */
+void deleteConvSpectrum(ConvSpectrum*s) {
+    if (s==NULL) return;
+    deleteFftPlan(s->rowPlan);
+    deleteFftPlan(s->colPlan);
+    free(s->data);
+    memset(s,0,sizeof(ConvSpectrum));
+    free(s);
+}
+
+/**
+ * @brief perform the convolution of the image of a spectrum with one
+ *        or two filters.
+ *
+ * Both filters are packed in a single complex transform, the first one
+ * as real part and the second one as imaginary part, and both results
+ * come out of a single inverse transform the same way. Raw values are
+ * rounded to the nearest integer then thresholded as in convApply, so
+ * results match the ones of convApply.
+ * @param s spectrum of the input image.
+ * @param fa first filter, of size s->fw by s->fh.
+ * @param fb second filter of the same size, or NULL.
+ * @param diff same meaning as in convApply.
+ * @param outA where the result for fa is written.
+ * @param outB where the result for fb is written, if fb is not NULL.
+ */
+void convApplySpectrum(ConvSpectrum*s,
+                       Filter*fa,
+                       Filter*fb,
+                       int diff,
+                       Img**outA,
+                       Img**outB)
+{
+    int fw=s->fw;
+    int fh=s->fh;
+    if (fa->img->width!=fw || fa->img->height!=fh ||
+        (fb && (fb->img->width!=fw || fb->img->height!=fh)))
+        ERROR("Filter size does not match spectrum.","");
+    int n=s->rowPlan->n;
+    int m=s->colPlan->n;
+    const short * wa = filterGetTaps(fa,diff);
+    const short * wb = fb?filterGetTaps(fb,diff):NULL;
+    double * z = (double*)malloc(sizeof(double)*2*n*m);
+    memset(z,0,sizeof(double)*2*n*m);
+    for (int y=0;y<fh;++y) {
+        for (int x=0;x<fw;++x) {
+            z[2*(x+n*y)]=wa[x+fw*y];
+            if (fb)
+                z[2*(x+n*y)+1]=wb[x+fw*y];
+        }
+    }
+    fft2d(s->rowPlan,s->colPlan,z,0,fh);
+    // with Z the transform of a+ib and A, B the transforms of a and b,
+    // Z[-k]=conj(A[k])+i.conj(B[k]) since a and b are real. Correlations
+    // are the inverse transforms of S.conj(A) and S.conj(B), which are
+    // real, so the inverse transform of S[k].Z[-k] gives the first one
+    // as real part and the second one as imaginary part.
+    for (int y=0;y<m;++y) {
+        int my=(m-y)%m;
+        for (int x=0;x<n;++x) {
+            int k=x+n*y;
+            int l=(n-x)%n+n*my;
+            if (l<k) continue;
+            double zkr=z[2*k],zki=z[2*k+1];
+            double zlr=z[2*l],zli=z[2*l+1];
+            double skr=s->data[2*k],ski=s->data[2*k+1];
+            double slr=s->data[2*l],sli=s->data[2*l+1];
+            z[2*k]=skr*zlr-ski*zli;
+            z[2*k+1]=skr*zli+ski*zlr;
+            z[2*l]=slr*zkr-sli*zki;
+            z[2*l+1]=slr*zki+sli*zkr;
+        }
+    }
+    fft2d(s->rowPlan,s->colPlan,z,1,s->height-fh+1);
+    int aw=s->width-fw+1;
+    int ah=s->height-fh+1;
+    double scale=1.0/((double)n*m);
+    *outA=newImgColor(aw,ah,0);
+    if (fb)
+        *outB=newImgColor(aw,ah,0);
+    for (int y=0;y<ah;++y) {
+        for (int x=0;x<aw;++x) {
+            const double * v=&z[2*(x+n*y)];
+            (*outA)->data[x+aw*y]=convRescale(fa,lround(v[0]*scale));
+            if (fb)
+                (*outB)->data[x+aw*y]=convRescale(fb,lround(v[1]*scale));
+        }
+    }
+    free(z);
+}
+
+/**
+ * @brief Lists the taps of a familly of filters which are not null in
+ *        at least one of the filters.
+ * @param filters count filters of the same size.
+ * @param count number of filters.
+ * @param diff same meaning as in convApply.
+ * @param taps where indexes of taps in the filter images are written,
+ *        enough room for all pixels of a filter.
+ * @return the number of taps written.
+ */
+static int convFamilyTaps(Filter**filters,int count,int diff,int*taps) {
+    int n=filters[0]->img->width*filters[0]->img->height;
+    int answer=0;
+    const short * w[count];
+    for (int j=0;j<count;++j) {
+        w[j]=filterGetTaps(filters[j],diff);
+    }
+    for (int i=0;i<n;++i) {
+        for (int j=0;j<count;++j) {
+            if (w[j][i]!=0) {
+                taps[answer++]=i;
+                break;
+            }
+        }
+    }
+    return answer;
+}
+
+/**
+ * @brief Tells if filters of a familly should be applied together by
+ *        convApplyFamily.
+ *
+ * The direct kernel reads the input once per filter and only for its
+ * non null taps. The familly engine reads it once for all filters but
+ * computes every tap which is not null in at least one filter. Filters
+ * whose results could overflow an integer are never applied together.
+ * @param filters count filters of the same size.
+ * @param count number of filters.
+ * @param diff same meaning as in convApply.
+ * @return non zero if convApplyFamily should be used.
+ */
+int convUseGemm(Filter**filters,int count,int diff) {
+    if (convGemmMode<0 || count<2) return 0;
+    long int direct=0;
+    for (int j=0;j<count;++j) {
+        if (filters[j]->tapBound[diff?1:0]>INT_MAX) return 0;
+        direct+=filters[j]->tapCount[diff?1:0];
+    }
+    if (convGemmMode>0) return 1;
+    int * taps = (int*)malloc(sizeof(int)*
+                              filters[0]->img->width*filters[0]->img->height);
+    long int gemm=(long int)count*convFamilyTaps(filters,count,diff,taps);
+    free(taps);
+    return gemm*CONV_GEMM_COST<direct*100;
+}
+
+/**
+ * @brief What the tasks of convApplyFamily share.
+ */
+struct convFamily {
+    /** input picture, padded if needed */
+    Img * src;
+    /** filters to apply */
+    Filter ** filters;
+    /** number of filters */
+    int count;
+    /** number of pairs of taps */
+    int pairs;
+    /** number of taps not null in at least one filter */
+    int tapCount;
+    /** offsets in src of the taps, 2*pairs values */
+    int * offsets;
+    /** weights, count rows of pairs packed pairs of taps */
+    int * a;
+    /** weights as doubles, count rows of tapCount taps */
+    double * ad;
+    /** number of rows of outputs computed by a task */
+    int rows;
+    /** the count resulting pictures */
+    Img ** out;
+};
+
+/**
+ * @brief Computes a band of rows of the outputs of convApplyFamily.
+ * @param arg a struct convFamily.
+ * @param t index of the band.
+ */
+static void convFamilyTask(void*arg,int t) {
+    struct convFamily * ctx = (struct convFamily*)arg;
+    Img * src = ctx->src;
+    int count=ctx->count;
+    int aw=ctx->out[0]->width;
+    int ah=ctx->out[0]->height;
+    int y1=(t+1)*ctx->rows<ah?(t+1)*ctx->rows:ah;
+    int * acc = (int*)malloc(sizeof(int)*count*CONV_GEMM_COLUMNS);
+#ifdef HAVE_CBLAS
+    int ld=ctx->tapCount>0?ctx->tapCount:1;
+    double * b = (double*)malloc(sizeof(double)*ld*CONV_GEMM_COLUMNS);
+    double * c = (double*)malloc(sizeof(double)*count*CONV_GEMM_COLUMNS);
+    memset(b,0,sizeof(double)*ld*CONV_GEMM_COLUMNS);
+#else
+    short * b = (short*)malloc(sizeof(short)*2*CONV_GEMM_COLUMNS*
+                               CONV_GEMM_PAIRS);
+    ConvGemmKernel gemm=convGemmScalar;
+    ConvPackKernel pack=convPackScalar;
+    switch (convGetIsa()) {
+#ifdef CONV_HAVE_X86
+    case CONV_ISA_AVX2:
+        gemm=convGemmAvx2;
+        pack=convPackSse2;
+        break;
+    case CONV_ISA_SSE2:
+        gemm=convGemmSse2;
+        pack=convPackSse2;
+        break;
+#endif
+    }
+#endif
+    for (int y=t*ctx->rows;y<y1;++y) {
+        for (int x0=0;x0<aw;x0+=CONV_GEMM_COLUMNS) {
+            int n=aw-x0<CONV_GEMM_COLUMNS?aw-x0:CONV_GEMM_COLUMNS;
+            const unsigned char * base = &src->data[x0+src->width*y];
+#ifdef HAVE_CBLAS
+            for (int k=0;k<ctx->tapCount;++k) {
+                for (int x=0;x<n;++x) {
+                    b[CONV_GEMM_COLUMNS*k+x]=base[ctx->offsets[k]+x];
+                }
+            }
+            // values are integers below 2^31, the product is exact
+            cblas_dgemm(CblasRowMajor,CblasNoTrans,CblasNoTrans,
+                        count,CONV_GEMM_COLUMNS,ctx->tapCount,
+                        1.0,ctx->ad,ld,b,CONV_GEMM_COLUMNS,
+                        0.0,c,CONV_GEMM_COLUMNS);
+            for (int i=0;i<count*CONV_GEMM_COLUMNS;++i) {
+                acc[i]=(int)c[i];
+            }
+#else
+            memset(acc,0,sizeof(int)*count*CONV_GEMM_COLUMNS);
+            for (int k0=0;k0<ctx->pairs;k0+=CONV_GEMM_PAIRS) {
+                int kp=ctx->pairs-k0<CONV_GEMM_PAIRS?
+                    ctx->pairs-k0:CONV_GEMM_PAIRS;
+                for (int k=0;k<kp;++k) {
+                    pack(base+ctx->offsets[2*(k0+k)],
+                         base+ctx->offsets[2*(k0+k)+1],
+                         n,b+2*CONV_GEMM_COLUMNS*k);
+                }
+                gemm(ctx->a+k0,ctx->pairs,count,b,kp,acc);
+            }
+#endif
+            for (int j=0;j<count;++j) {
+                for (int x=0;x<n;++x) {
+                    ctx->out[j]->data[x0+x+aw*y]=
+                        convRescale(ctx->filters[j],
+                                    acc[CONV_GEMM_COLUMNS*j+x]);
+                }
+            }
+        }
+    }
+#ifdef HAVE_CBLAS
+    free(c);
+#endif
+    free(b);
+    free(acc);
+}
+
+/**
+ * @brief perform the convolutions of an image by a familly of filters
+ *        in one pass.
+ *
+ * Filters are stacked in a matrix of weights. For each tile of
+ * CONV_GEMM_COLUMNS outputs of a row, the pixels seen by every tap are
+ * packed once in a matrix and multiplied by the weights, which
+ * computes the tile for all filters at once. When the program is
+ * configured with a cblas library the product is done by cblas_dgemm.
+ * Bands of rows are computed in parallel by poolFor.
+ * Results are the same as the ones of convApply.
+ * @param in the input picture.
+ * @param filters count filters of the same size.
+ * @param count number of filters.
+ * @param diff same meaning as in convApply.
+ * @param sameSize same meaning as in convApply.
+ * @param out where the count newly allocated results are written.
+ * @see convUseGemm
+ */
+void convApplyFamily(Img*in,
+                     Filter**filters,
+                     int count,
+                     int diff,
+                     int sameSize,
+                     Img**out)
+{
+    int fw=filters[0]->img->width;
+    int fh=filters[0]->img->height;
+    for (int j=1;j<count;++j) {
+        if (filters[j]->img->width!=fw || filters[j]->img->height!=fh)
+            ERROR("Filters of the familly do not have the same size.","");
+    }
+    struct convFamily ctx;
+    ctx.src = sameSize?convPad(in,fw,fh):in;
+    ctx.filters=filters;
+    ctx.count=count;
+    ctx.out=out;
+    int aw=ctx.src->width-fw+1;
+    int ah=ctx.src->height-fh+1;
+    int * taps = (int*)malloc(sizeof(int)*(fw*fh+1));
+    ctx.tapCount=convFamilyTaps(filters,count,diff,taps);
+    // an odd last tap is paired with itself and a null weight
+    ctx.pairs=(ctx.tapCount+1)/2;
+    ctx.offsets = (int*)malloc(sizeof(int)*(2*ctx.pairs+1));
+    for (int t=0;t<ctx.tapCount;++t) {
+        ctx.offsets[t]=taps[t]%fw+ctx.src->width*(taps[t]/fw);
+    }
+    if (ctx.tapCount%2) ctx.offsets[ctx.tapCount]=ctx.offsets[ctx.tapCount-1];
+    ctx.a = (int*)malloc(sizeof(int)*(count*ctx.pairs+1));
+    ctx.ad = (double*)malloc(sizeof(double)*(count*ctx.tapCount+1));
+    for (int j=0;j<count;++j) {
+        const short * d = filterGetTaps(filters[j],diff);
+        for (int k=0;k<ctx.pairs;++k) {
+            int w0=d[taps[2*k]];
+            int w1=(2*k+1<ctx.tapCount)?d[taps[2*k+1]]:0;
+            ctx.a[ctx.pairs*j+k]=(int)((w0&0xffffu)|((w1&0xffffu)<<16));
+        }
+        for (int t=0;t<ctx.tapCount;++t) {
+            ctx.ad[ctx.tapCount*j+t]=d[taps[t]];
+        }
+    }
+    for (int j=0;j<count;++j) {
+        out[j]=newImgColor(aw,ah,0);
+    }
+    // a few bands per thread so that they balance
+    int bands=4*poolGetThreads();
+    ctx.rows=(ah+bands-1)/bands;
+    if (ctx.rows<1) ctx.rows=1;
+    poolFor((ah+ctx.rows-1)/ctx.rows,convFamilyTask,&ctx);
+    free(ctx.ad);
+    free(ctx.a);
+    free(ctx.offsets);
+    free(taps);
+    if (ctx.src!=in)
+        deleteImg(ctx.src);
+}
+
+/**
+ * @brief Use of the Winograd path for 3x3 and 5x5 filters: 0 lets
+ *        convUseWinograd decide, a positive value forces it, a negative
+ *        value forbids it.
+ */
+int convWinogradMode=0;
+
+/**
+ * @brief Smallest number of filters of a familly for which the
+ *        Winograd path beats the scalar row kernel, indexed by the
+ *        size of the filters, INT_MAX when it never does. With 3x3
+ *        filters the transforms cost more than the multiplications
+ *        they save.
+ */
+static const int convWinogradMinCount[6]={0,0,0,INT_MAX,0,4};
+
+/**
+ * @brief Applies the transpose of B of F(2,3) to 4 values.
+ * @param d values read every step integers.
+ * @param step distance between two values of d.
+ * @param v where the 4 results are written, every step integers.
+ */
+static void convWinogradIn3(const long long * d,int step,long long * v) {
+    long long d0=d[0],d1=d[step],d2=d[2*step],d3=d[3*step];
+    v[0]=d0-d2;
+    v[step]=d1+d2;
+    v[2*step]=d2-d1;
+    v[3*step]=d1-d3;
+}
+
+/**
+ * @brief Applies the transpose of B of F(2,5) to 6 values.
+ * @see convWinogradIn3
+ */
+static void convWinogradIn5(const long long * d,int step,long long * v) {
+    long long d0=d[0],d1=d[step],d2=d[2*step];
+    long long d3=d[3*step],d4=d[4*step],d5=d[5*step];
+    v[0]=4*d0-5*d2+d4;
+    v[step]=d3+d4-4*(d1+d2);
+    v[2*step]=4*(d1-d2)+d4-d3;
+    v[3*step]=2*(d3-d1)+d4-d2;
+    v[4*step]=2*(d1-d3)+d4-d2;
+    v[5*step]=4*d1-5*d3+d5;
+}
+
+/**
+ * @brief Applies G of F(2,3), multiplied by 2, to the 3 taps of a
+ *        column or a row of a filter.
+ * @see convWinogradIn3
+ */
+static void convWinogradFilter3(const long long * g,int step,long long * u) {
+    long long g0=g[0],g1=g[step],g2=g[2*step];
+    u[0]=2*g0;
+    u[step]=g0+g1+g2;
+    u[2*step]=g0-g1+g2;
+    u[3*step]=2*g2;
+}
+
+/**
+ * @brief Applies G of F(2,5), multiplied by 24, to the 5 taps of a
+ *        column or a row of a filter.
+ * @see convWinogradIn3
+ */
+static void convWinogradFilter5(const long long * g,int step,long long * u) {
+    long long g0=g[0],g1=g[step],g2=g[2*step],g3=g[3*step],g4=g[4*step];
+    u[0]=6*g0;
+    u[step]=-4*(g0+g1+g2+g3+g4);
+    u[2*step]=-4*(g0-g1+g2-g3+g4);
+    u[3*step]=g0+2*g1+4*g2+8*g3+16*g4;
+    u[4*step]=g0-2*g1+4*g2-8*g3+16*g4;
+    u[5*step]=24*g4;
+}
+
+/**
+ * @brief Applies the transpose of A of F(2,3) to 4 values.
+ * @see convWinogradIn3
+ */
+static void convWinogradOut3(const long long * m,int step,long long * y) {
+    y[0]=m[0]+m[step]+m[2*step];
+    y[step]=m[step]-m[2*step]-m[3*step];
+}
+
+/**
+ * @brief Applies the transpose of A of F(2,5) to 6 values.
+ * @see convWinogradIn3
+ */
+static void convWinogradOut5(const long long * m,int step,long long * y) {
+    y[0]=m[0]+m[step]+m[2*step]+m[3*step]+m[4*step];
+    y[step]=m[step]-m[2*step]+2*(m[3*step]-m[4*step])+m[5*step];
+}
+
+/**
+ * @brief One dimension transform of the Winograd path.
+ */
+typedef void (*ConvWinogradTransform)(const long long * in,
+                                      int step,
+                                      long long * out);
+
+/**
+ * @brief Tells if filters of a familly should be applied by
+ *        convApplyWinograd.
+ *
+ * Only 3x3 and 5x5 filters can. The Winograd path needs fewer
+ * multiplications than the direct kernel but more additions, so it
+ * only pays when the row kernel has no vector instruction, and the
+ * transform of the image is shared by enough filters.
+ * @param filters count filters of the same size.
+ * @param count number of filters.
+ * @return non zero if convApplyWinograd should be used.
+ */
+int convUseWinograd(Filter**filters,int count) {
+    if (convWinogradMode<0 || count<1) return 0;
+    int r=filters[0]->img->width;
+    if ((r!=3 && r!=5) || filters[0]->img->height!=r) return 0;
+    for (int j=1;j<count;++j) {
+        if (filters[j]->img->width!=r || filters[j]->img->height!=r)
+            return 0;
+    }
+    if (convWinogradMode>0) return 1;
+    return convGetIsa()==CONV_ISA_SCALAR && count>=convWinogradMinCount[r];
+}
+
+/**
+ * @brief What the tasks of convApplyWinograd share.
+ */
+struct convWinograd {
+    /** input picture, padded if needed */
+    Img * src;
+    /** filters to apply */
+    Filter ** filters;
+    /** number of filters */
+    int count;
+    /** size of the filters */
+    int r;
+    /** transformed filters, count times (r+1)*(r+1) values */
+    long long * u;
+    /** number of rows of tiles computed by a task */
+    int rows;
+    /** the count resulting pictures */
+    Img ** out;
+};
+
+/**
+ * @brief Computes a band of rows of tiles of convApplyWinograd.
+ * @param arg a struct convWinograd.
+ * @param t index of the band.
+ */
+static void convWinogradTask(void*arg,int t) {
+    struct convWinograd * ctx = (struct convWinograd*)arg;
+    Img * src = ctx->src;
+    int n=ctx->r+1;
+    ConvWinogradTransform in=ctx->r==3?convWinogradIn3:convWinogradIn5;
+    ConvWinogradTransform out=ctx->r==3?convWinogradOut3:convWinogradOut5;
+    // the filter transform is multiplied by 2 or 24 in each direction
+    long long scale=ctx->r==3?4:576;
+    int aw=ctx->out[0]->width;
+    int ah=ctx->out[0]->height;
+    int tw=(aw+1)/2;
+    int th=(ah+1)/2;
+    int ty1=(t+1)*ctx->rows<th?(t+1)*ctx->rows:th;
+    long long d[n*n],v[n*n],m[n*n],p[2*n],y[4];
+    for (int ty=t*ctx->rows;ty<ty1;++ty) {
+        for (int tx=0;tx<tw;++tx) {
+            const unsigned char * base = &src->data[2*tx+src->width*2*ty];
+            if (2*tx+n<=src->width && 2*ty+n<=src->height) {
+                for (int yy=0;yy<n;++yy) {
+                    for (int xx=0;xx<n;++xx) {
+                        d[xx+n*yy]=base[xx+src->width*yy];
+                    }
+                }
+            } else {
+                // the last tile of a row or column goes past the picture
+                for (int yy=0;yy<n;++yy) {
+                    for (int xx=0;xx<n;++xx) {
+                        d[xx+n*yy]=(2*tx+xx<src->width &&
+                                    2*ty+yy<src->height)?
+                            base[xx+src->width*yy]:0;
+                    }
+                }
+            }
+            for (int yy=0;yy<n;++yy) {
+                in(&d[n*yy],1,&v[n*yy]);
+            }
+            for (int xx=0;xx<n;++xx) {
+                in(&v[xx],n,&d[xx]);
+            }
+            for (int j=0;j<ctx->count;++j) {
+                const long long * u = &ctx->u[n*n*j];
+                for (int i=0;i<n*n;++i) {
+                    m[i]=u[i]*d[i];
+                }
+                for (int xx=0;xx<n;++xx) {
+                    out(&m[xx],n,&p[xx]);
+                }
+                out(&p[0],1,&y[0]);
+                out(&p[n],1,&y[2]);
+                Img * o = ctx->out[j];
+                for (int k=0;k<4;++k) {
+                    int x=2*tx+k%2;
+                    int yo=2*ty+k/2;
+                    if (x<aw && yo<ah)
+                        o->data[x+aw*yo]=convRescale(ctx->filters[j],
+                                                     y[k]/scale);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief perform the convolutions of an image by a familly of 3x3 or
+ *        5x5 filters with the Winograd F(2x2,3x3) or F(2x2,5x5)
+ *        algorithm.
+ *
+ * Each tile of 2x2 outputs is computed from a tile of (r+1)x(r+1)
+ * pixels with (r+1)*(r+1) multiplications instead of 4*r*r. The
+ * transform of a tile of the image is shared by all filters.
+ * Transforms are done on integers, the filter transform being
+ * multiplied by 2 or 24 in each direction, so results are exact and
+ * the same as the ones of convApply. Bands of rows are computed in
+ * parallel by poolFor.
+ * @param in the input picture.
+ * @param filters count filters, all 3x3 or all 5x5.
+ * @param count number of filters.
+ * @param diff same meaning as in convApply.
+ * @param sameSize same meaning as in convApply.
+ * @param out where the count newly allocated results are written.
+ * @see convUseWinograd
+ */
+void convApplyWinograd(Img*in,
+                       Filter**filters,
+                       int count,
+                       int diff,
+                       int sameSize,
+                       Img**out)
+{
+    int r=filters[0]->img->width;
+    if (r!=3 && r!=5)
+        ERROR("Winograd needs 3x3 or 5x5 filters.","");
+    for (int j=0;j<count;++j) {
+        if (filters[j]->img->width!=r || filters[j]->img->height!=r)
+            ERROR("Filters of the familly do not have the same size.","");
+    }
+    int n=r+1;
+    ConvWinogradTransform filter=r==3?convWinogradFilter3:convWinogradFilter5;
+    struct convWinograd ctx;
+    ctx.src = sameSize?convPad(in,r,r):in;
+    ctx.filters=filters;
+    ctx.count=count;
+    ctx.r=r;
+    ctx.out=out;
+    ctx.u = (long long*)malloc(sizeof(long long)*n*n*count);
+    for (int j=0;j<count;++j) {
+        const short * w = filterGetTaps(filters[j],diff);
+        long long g[r*r],h[n*r];
+        for (int i=0;i<r*r;++i) {
+            g[i]=w[i];
+        }
+        // columns first, then rows of the n by r result
+        for (int x=0;x<r;++x) {
+            filter(&g[x],r,&h[x]);
+        }
+        for (int y=0;y<n;++y) {
+            filter(&h[r*y],1,&ctx.u[n*n*j+n*y]);
+        }
+    }
+    int aw=ctx.src->width-r+1;
+    int ah=ctx.src->height-r+1;
+    for (int j=0;j<count;++j) {
+        out[j]=newImgColor(aw,ah,0);
+    }
+    int th=(ah+1)/2;
+    int bands=4*poolGetThreads();
+    ctx.rows=(th+bands-1)/bands;
+    if (ctx.rows<1) ctx.rows=1;
+    poolFor((th+ctx.rows-1)/ctx.rows,convWinogradTask,&ctx);
+    free(ctx.u);
+    if (ctx.src!=in)
+        deleteImg(ctx.src);
+}
@@ -0,0 +1,94 @@
+#ifndef CONV_H
+#define CONV_H
+
+/**
+ * @file conv.h
+ * @brief Header of the convolution engine used by the imgConvolution*
+ *        functions.
+ */
+
+#include "img.h"
+#include "fft.h"
+
+/**
+ * @brief Instruction sets the convolution engine can run on.
+ */
+enum convIsa {
+    /** pick the best instruction set supported by the cpu */
+    CONV_ISA_AUTO=-1,
+    /** plain C, no vector instruction */
+    CONV_ISA_SCALAR=0,
+    /** 128 bits vectors */
+    CONV_ISA_SSE2=1,
+    /** 256 bits vectors */
+    CONV_ISA_AVX2=2
+};
+
+/**
+ * @brief Fourier transform of an image, computed once and shared by
+ *        all the filters of a familly.
+ */
+struct convSpectrum {
+    /** width of the transformed image, padded if sameSize is set */
+    int width;
+    /** height of the transformed image, padded if sameSize is set */
+    int height;
+    /** width of the filters the spectrum was made for */
+    int fw;
+    /** height of the filters the spectrum was made for */
+    int fh;
+    /** same meaning as in convApply */
+    int sameSize;
+    /** plan to transform rows */
+    FftPlan * rowPlan;
+    /** plan to transform columns */
+    FftPlan * colPlan;
+    /** rowPlan->n times colPlan->n complex values */
+    double * data;
+};
+
+/**
+ * @brief Short name for 'struct convSpectrum'
+ */
+typedef struct convSpectrum ConvSpectrum;
+
+extern int convIsa;
+extern int convFftMode;
+extern int convGemmMode;
+extern int convWinogradMode;
+
+int convGetIsa();
+const char * convIsaName(int isa);
+Img * convApply(Img*in,Filter*filter,int diff,int sameSize);
+Img * convApplySeparable(Img*in,Filter*filter,int sameSize);
+Img * convApplyMaxPool(Img*in,
+                       Filter*filter,
+                       int diff,
+                       int sameSize,
+                       int poolsize,
+                       int stride);
+int convUseFft(int w,int h,Filter*filter,int diff,int sameSize,int count);
+ConvSpectrum * newConvSpectrum(Img*in,int fw,int fh,int sameSize);
+void deleteConvSpectrum(ConvSpectrum*);
+void convApplySpectrum(ConvSpectrum*s,
+                       Filter*fa,
+                       Filter*fb,
+                       int diff,
+                       Img**outA,
+                       Img**outB);
+int convUseGemm(Filter**filters,int count,int diff);
+void convApplyFamily(Img*in,
+                     Filter**filters,
+                     int count,
+                     int diff,
+                     int sameSize,
+                     Img**out);
+int convUseWinograd(Filter**filters,int count);
+void convApplyWinograd(Img*in,
+                       Filter**filters,
+                       int count,
+                       int diff,
+                       int sameSize,
+                       Img**out);
+
+#endif
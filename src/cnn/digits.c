@@ -5,6 +5,7 @@
 #include "filterfam.h"
 #include "digits.h"
 #include "layer.h"
+#include "pool.h"
 
 /**
  * @brief allocates a memory for a new set of filters to detect 
@@ -441,8 +442,15 @@ void digitsUsage(FILE*f,char*name) {
     fprintf(f,"         creates the filters to detect digits for layer <n> \n");
     fprintf(f,"         in directory:\n");
     fprintf(f,"             %s/digits\n",CFG_DATAROOTDIR);
+    fprintf(f,"         and packs them again if the directory has a bank.\n");
     fprintf(f,"    [-t|--test] <n>:\n");
     fprintf(f,"         tests the filters for digits.\n");
+    fprintf(f,"    [-p|--pack] :\n");
+    fprintf(f,"         packs all the filters of the directory above in\n");
+    fprintf(f,"         a single file read at once.\n");
+    fprintf(f,"    --threads <n> :\n");
+    fprintf(f,"         number of threads to use, by default the value of\n");
+    fprintf(f,"         CNN_THREADS or the number of processors.\n");
     fprintf(f,"    [-h|--help] :\n");
     fprintf(f,"         display this help message and exits.\n");
 }
@@ -478,6 +486,11 @@ int digitsMain(int argc,char**argv) {
             } else {
                 generateLayer3();
             }
+            // the families saved are put in the bank once they are
+            // all written
+            char dir[sizeof(layerPrefix)];
+            snprintf(dir,sizeof(dir),"%s/digits",CFG_DATAROOTDIR);
+            if (filterFamHasBank(dir)) filterFamPack(dir);
         } else if (strcmp(argv[i],"--test")==0 ||
                    strcmp(argv[i],"-t")==0 ) {
             ++i;
@@ -497,6 +510,18 @@ int digitsMain(int argc,char**argv) {
             } else if (t==3) {
                generateTestData();
             }
+        } else if (strcmp(argv[i],"--pack")==0 ||
+                   strcmp(argv[i],"-p")==0 ) {
+            char dir[sizeof(layerPrefix)];
+            snprintf(dir,sizeof(dir),"%s/digits",CFG_DATAROOTDIR);
+            printf("%d families packed.\n",filterFamPack(dir));
+        } else if (strcmp(argv[i],"--threads")==0) {
+            ++i;
+            if (i>=argc) {
+                digitsUsage(stderr,argv[0]);
+                ERROR("--threads expects the number of threads","");
+            }
+            poolThreads=atoi(argv[i]);
         } else if (strcmp(argv[i],"--help")==0 ||
                    strcmp(argv[i],"-h")==0 ) {
             digitsUsage(stdout,argv[0]);
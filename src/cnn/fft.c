@@ -0,0 +1,262 @@
+#include <math.h>
+#include "fft.h"
+
+/**
+ * @file fft.c
+ * @brief Implements the fast Fourier transform defined in fft.h.
+ *
+ * Complex values are stored as pairs of doubles: real part followed
+ * by imaginary part. The transform is a recursive decimation in time:
+ * a transform of size n=p*m is made of p transforms of size m combined
+ * by butterflies of radix p. Radix 2 and 4 have dedicated butterflies,
+ * other radixes use a generic O(p*p) one, so sizes with only small
+ * prime factors should be preferred (see fftGoodSize).
+ */
+
+/**
+ * @brief Allocates a plan to compute transforms of n complex values.
+ * @param n size of the transform.
+ * @return the newly allocated plan, to be freed with deleteFftPlan.
+ */
+FftPlan * newFftPlan(int n) {
+    if (n<1)
+        ERROR("Wrong fft size.","");
+    FftPlan * answer = (FftPlan*)malloc(sizeof(struct fftPlan));
+    answer->n=n;
+    answer->factorCount=0;
+    int r=n;
+    int p=4;
+    while (r>1) {
+        while (r%p!=0) {
+            // after 4 try 2, then odd numbers
+            if (p==4) p=2;
+            else if (p==2) p=3;
+            else p+=2;
+            if (p*p>r) p=r;
+        }
+        answer->factors[answer->factorCount++]=p;
+        r/=p;
+    }
+    answer->twiddles=(double*)malloc(sizeof(double)*2*n);
+    for (int k=0;k<n;++k) {
+        double a=-2*M_PI*k/n;
+        answer->twiddles[2*k]=cos(a);
+        answer->twiddles[2*k+1]=sin(a);
+    }
+    return answer;
+}
+
+/**
+ * @brief Releases memory allocated for a plan.
+ * @param plan the plan to free. Nothing happens if plan is NULL.
+ */
+void deleteFftPlan(FftPlan*plan) {
+    if (plan==NULL) return;
+    free(plan->twiddles);
+    memset(plan,0,sizeof(FftPlan));
+    free(plan);
+}
+
+/**
+ * @brief Gives the smallest size greater or equal to n with no other
+ *        prime factor than 2, 3 and 5.
+ * @param n a positive number.
+ * @return a size the transform handles efficiently.
+ */
+int fftGoodSize(int n) {
+    for (int answer=n;;++answer) {
+        int r=answer;
+        while (r%2==0) r/=2;
+        while (r%3==0) r/=3;
+        while (r%5==0) r/=5;
+        if (r==1) return answer;
+    }
+}
+
+/**
+ * @brief Recursive step of the transform.
+ * @param plan the plan of the whole transform.
+ * @param out where the n values of the transform are written.
+ * @param in first input value.
+ * @param n size of this sub transform.
+ * @param stride distance in complex values between two inputs.
+ * @param level index in plan->factors of the radix to use.
+ * @param inverse if not zero the twiddles are conjugated.
+ */
+static void fftStep(FftPlan*plan,
+                    double*out,
+                    const double*in,
+                    int n,
+                    int stride,
+                    int level,
+                    int inverse)
+{
+    int p=plan->factors[level];
+    int m=n/p;
+    if (m==1) {
+        for (int k=0;k<p;++k) {
+            out[2*k]=in[2*k*stride];
+            out[2*k+1]=in[2*k*stride+1];
+        }
+    } else {
+        for (int j=0;j<p;++j) {
+            fftStep(plan,&out[2*j*m],&in[2*j*stride],m,stride*p,
+                    level+1,inverse);
+        }
+    }
+    const double * tw=plan->twiddles;
+    int step=plan->n/n;
+    double s=inverse?-1:1;
+    if (p==2) {
+        for (int k=0;k<m;++k) {
+            double wr=tw[2*k*step];
+            double wi=s*tw[2*k*step+1];
+            double * a=&out[2*k];
+            double * b=&out[2*(k+m)];
+            double br=b[0]*wr-b[1]*wi;
+            double bi=b[0]*wi+b[1]*wr;
+            b[0]=a[0]-br;
+            b[1]=a[1]-bi;
+            a[0]+=br;
+            a[1]+=bi;
+        }
+    } else if (p==4) {
+        for (int k=0;k<m;++k) {
+            double t[8];
+            for (int j=0;j<4;++j) {
+                double wr=tw[2*j*k*step];
+                double wi=s*tw[2*j*k*step+1];
+                double * v=&out[2*(k+j*m)];
+                t[2*j]=v[0]*wr-v[1]*wi;
+                t[2*j+1]=v[0]*wi+v[1]*wr;
+            }
+            // multiply by -i for the forward transform, i for the inverse
+            double ar=t[0]+t[4], ai=t[1]+t[5];
+            double br=t[0]-t[4], bi=t[1]-t[5];
+            double cr=t[2]+t[6], ci=t[3]+t[7];
+            double dr=s*(t[3]-t[7]), di=-s*(t[2]-t[6]);
+            out[2*k]=ar+cr;           out[2*k+1]=ai+ci;
+            out[2*(k+m)]=br+dr;       out[2*(k+m)+1]=bi+di;
+            out[2*(k+2*m)]=ar-cr;     out[2*(k+2*m)+1]=ai-ci;
+            out[2*(k+3*m)]=br-dr;     out[2*(k+3*m)+1]=bi-di;
+        }
+    } else {
+        double t[2*p];
+        int pstep=plan->n/p;
+        for (int k=0;k<m;++k) {
+            for (int j=0;j<p;++j) {
+                double wr=tw[2*j*k*step];
+                double wi=s*tw[2*j*k*step+1];
+                double * v=&out[2*(k+j*m)];
+                t[2*j]=v[0]*wr-v[1]*wi;
+                t[2*j+1]=v[0]*wi+v[1]*wr;
+            }
+            for (int q=0;q<p;++q) {
+                double r=0,i=0;
+                for (int j=0;j<p;++j) {
+                    int e=((j*q)%p)*pstep;
+                    double wr=tw[2*e];
+                    double wi=s*tw[2*e+1];
+                    r+=t[2*j]*wr-t[2*j+1]*wi;
+                    i+=t[2*j]*wi+t[2*j+1]*wr;
+                }
+                out[2*(k+q*m)]=r;
+                out[2*(k+q*m)+1]=i;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Computes in place the Fourier transform of plan->n complex
+ *        values.
+ *
+ * The inverse transform is not scaled: applying the forward then the
+ * inverse transform multiplies values by plan->n.
+ * @param plan plan made for the size of data.
+ * @param data 2*plan->n doubles, overwritten by the transform.
+ * @param work 2*plan->n doubles used as scratch space.
+ * @param inverse if not zero the inverse transform is computed.
+ */
+void fftRun(FftPlan*plan,double*data,double*work,int inverse) {
+    memcpy(work,data,sizeof(double)*2*plan->n);
+    fftStep(plan,data,work,plan->n,1,0,inverse);
+}
+
+/**
+ * @brief Number of columns gathered together by fft2d, so that each
+ *        cache line read from the data is used for several columns.
+ */
+#define FFT_COLUMN_BLOCK 8
+
+/**
+ * @brief Applies the transform to the columns of a 2 dimensional array.
+ * @param rowPlan plan of the size of a row.
+ * @param colPlan plan of the size of a column.
+ * @param data 2*rowPlan->n*colPlan->n doubles stored row by row.
+ * @param work 2*(FFT_COLUMN_BLOCK+1)*colPlan->n doubles of scratch space.
+ * @param inverse if not zero the inverse transform is computed.
+ */
+static void fftColumns(FftPlan*rowPlan,
+                       FftPlan*colPlan,
+                       double*data,
+                       double*work,
+                       int inverse)
+{
+    int w=rowPlan->n;
+    int h=colPlan->n;
+    double * tmp = work+2*FFT_COLUMN_BLOCK*h;
+    for (int x0=0;x0<w;x0+=FFT_COLUMN_BLOCK) {
+        int bw=w-x0<FFT_COLUMN_BLOCK?w-x0:FFT_COLUMN_BLOCK;
+        for (int y=0;y<h;++y) {
+            const double * row=&data[2*(x0+w*y)];
+            for (int b=0;b<bw;++b) {
+                work[2*(b*h+y)]=row[2*b];
+                work[2*(b*h+y)+1]=row[2*b+1];
+            }
+        }
+        for (int b=0;b<bw;++b) {
+            fftRun(colPlan,&work[2*b*h],tmp,inverse);
+        }
+        for (int y=0;y<h;++y) {
+            double * row=&data[2*(x0+w*y)];
+            for (int b=0;b<bw;++b) {
+                row[2*b]=work[2*(b*h+y)];
+                row[2*b+1]=work[2*(b*h+y)+1];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Computes in place the 2 dimensional Fourier transform of
+ *        rowPlan->n by colPlan->n complex values.
+ *
+ * Only the first rows of the data may matter, which saves row
+ * transforms: for the forward transform the other rows must be zero,
+ * for the inverse transform the other rows are left partially
+ * transformed and should not be used.
+ * @param rowPlan plan of the size of a row.
+ * @param colPlan plan of the size of a column.
+ * @param data 2*rowPlan->n*colPlan->n doubles stored row by row.
+ * @param inverse if not zero the inverse transform is computed.
+ * @param rows number of rows that matter, at most colPlan->n.
+ */
+void fft2d(FftPlan*rowPlan,FftPlan*colPlan,double*data,int inverse,int rows) {
+    int w=rowPlan->n;
+    int h=colPlan->n;
+    int l=w>(FFT_COLUMN_BLOCK+1)*h?w:(FFT_COLUMN_BLOCK+1)*h;
+    double * work = (double*)malloc(sizeof(double)*2*l);
+    if (!inverse) {
+        for (int y=0;y<rows;++y) {
+            fftRun(rowPlan,&data[2*w*y],work,inverse);
+        }
+    }
+    fftColumns(rowPlan,colPlan,data,work,inverse);
+    if (inverse) {
+        for (int y=0;y<rows;++y) {
+            fftRun(rowPlan,&data[2*w*y],work,inverse);
+        }
+    }
+    free(work);
+}
@@ -0,0 +1,41 @@
+#ifndef FFT_H
+#define FFT_H
+
+/**
+ * @file fft.h
+ * @brief Header of a small mixed radix fast Fourier transform.
+ */
+
+#include "util.h"
+
+/**
+ * @brief Data needed to compute the Fourier transform of n complex
+ *        values.
+ */
+struct fftPlan {
+    /** number of complex values */
+    int n;
+    /** number of factors of n */
+    int factorCount;
+    /** factors of n, radix used at each step of the transform */
+    int factors[32];
+    /** 2*n values: cosine and sine of -2*pi*k/n */
+    double * twiddles;
+};
+
+/**
+ * @brief Short name for 'struct fftPlan'
+ */
+typedef struct fftPlan FftPlan;
+
+FftPlan * newFftPlan(int n);
+void deleteFftPlan(FftPlan*);
+int fftGoodSize(int n);
+void fftRun(FftPlan*plan,double*data,double*work,int inverse);
+void fft2d(FftPlan*rowPlan,
+           FftPlan*colPlan,
+           double*data,
+           int inverse,
+           int rows);
+
+#endif
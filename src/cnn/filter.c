@@ -1,6 +1,33 @@
 #include "filter.h"
+#include "tensor.h"
 #include <math.h>
 
+/**
+ * @brief if not zero filters are never turned into their
+ *        separable form and convolutions use every pixel of the filter.
+ */
+int filterForceExact=0;
+
+/**
+ * @brief maximum relative error allowed for the separable form of a
+ *        filter.
+ *
+ * The error is the Frobenius norm of the difference between the filter
+ * and its separable form divided by the Frobenius norm of the filter.
+ */
+double filterSeparableTolerance=0.01;
+
+/**
+ * @brief how many 16 bits multiply-add of the direct convolution
+ *        cost as much as a single precision one of the separable form.
+ */
+#define FILTER_SEPARABLE_COST 4
+
+/**
+ * @brief alignment in bytes of the taps built by filterGetTaps.
+ */
+#define FILTER_TAPS_ALIGN 32
+
 /**
  * @brief Allocates space for a new filter
  * @param img image on which the filter is based
@@ -16,6 +43,13 @@ Filter * newFilter(Img* img,int percent) {
     answer->weight=0;
     answer->maxVal=0;
     answer->data=NULL;
+    answer->sepRank=0;
+    answer->sepCol=NULL;
+    answer->sepRow=NULL;
+    answer->taps[0]=NULL;
+    answer->taps[1]=NULL;
+    answer->rescaleMul=0;
+    answer->rescaleShift=0;
     if (img==NULL) return answer;
     filterUpdateValues(answer);
     return answer;
@@ -35,6 +69,10 @@ void deleteFilter(Filter*f) {
     f->maxVal=0;
     if (f->data!=NULL)
         free(f->data);
+    free(f->sepCol);
+    free(f->sepRow);
+    free(f->taps[0]);
+    free(f->taps[1]);
     memset(f,0,sizeof(Filter));
     free(f);
 }
@@ -65,9 +103,34 @@ void filterSetWeight(Filter*f,int w) {
     filterUpdateValues(f);
 }
 
+/**
+ * @brief Computes the fixed point reciprocal used to rescale results
+ *        of convolutions.
+ *
+ * With d=maxVal-threshold and l the smallest integer such that
+ * d<=2^l, m=ceil(2^(31+l)/d) gives floor(n/d)=(n*m)>>(31+l) for all
+ * n below 2^31 (Granlund and Montgomery), and n*m fits in 64 bits.
+ * Rescaled values are 255*(v-threshold)/d with v at most maxVal, so
+ * the reciprocal is only set when 255*d is below 2^31.
+ * @param f filter to update.
+ */
+static void filterUpdateRescale(Filter*f) {
+    long int d=f->maxVal-f->threshold;
+    f->rescaleMul=0;
+    f->rescaleShift=0;
+    if (d<=0 || d>=(1L<<31)/255) return;
+    int l=0;
+    while ((1L<<l)<d) ++l;
+    f->rescaleShift=31+l;
+    f->rescaleMul=((1ULL<<(31+l))+d-1)/d;
+}
+
 /**
  * @brief Updates weight, threshold and maxVal values in a filter
  *        given the image and the percentage threshold should have.
+ *
+ * Taps built by filterGetTaps are dropped since the image may have
+ * changed.
  * @param f filter to update
  */
 void filterUpdateValues(Filter*f) {
@@ -77,10 +140,169 @@ void filterUpdateValues(Filter*f) {
     if (f->percent>100 || f->percent<-100) {
         ERROR("percent should be between 0 and 100.","");
     }
+    for (int diff=0;diff<2;++diff) {
+        free(f->taps[diff]);
+        f->taps[diff]=NULL;
+        f->tapBound[diff]=0;
+        f->tapCount[diff]=0;
+    }
     for(int i = 0; i < f->img->height*f->img->width; i++) {
-        f->weight+=f->img->data[i]-128;
+        int v=f->img->data[i];
+        f->weight+=v-128;
+        f->tapBound[0]+=255*v;
+        f->tapBound[1]+=255*(v<128?128-v:v-128);
+        if (v!=0) f->tapCount[0]++;
+        if (v!=128) f->tapCount[1]++;
     }
     f->threshold=f->maxVal*f->percent/100;
+    filterUpdateRescale(f);
+    filterUpdateSeparable(f);
+}
+
+/**
+ * @brief Gets the taps of a filter as used by convolutions.
+ *
+ * Taps are built on first use and kept until the filter changes.
+ * Several threads may ask for them at the same time: each builds
+ * its own copy, the first one published is kept and the others are
+ * freed.
+ * @param f a filter.
+ * @param diff if not zero 128 is substracted to each pixel.
+ * @return img->width*img->height taps aligned on FILTER_TAPS_ALIGN
+ *         bytes, owned by the filter.
+ */
+const short * filterGetTaps(Filter*f,int diff) {
+    diff=diff?1:0;
+    short * answer=__atomic_load_n(&f->taps[diff],__ATOMIC_ACQUIRE);
+    if (answer!=NULL) return answer;
+    int n=f->img->width*f->img->height;
+    void * p=NULL;
+    if (posix_memalign(&p,FILTER_TAPS_ALIGN,sizeof(short)*(n>0?n:1)))
+        ERROR("Could not allocate taps.","");
+    answer=(short*)p;
+    for (int i=0;i<n;++i) {
+        answer[i]=f->img->data[i]-(diff?128:0);
+    }
+    short * expected=NULL;
+    if (!__atomic_compare_exchange_n(&f->taps[diff],&expected,answer,0,
+                                     __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+        free(answer);
+        answer=expected;
+    }
+    return answer;
+}
+
+/**
+ * @brief Looks for a separable form of the filter.
+ *
+ * The filter pixels minus 128, seen as a height by width matrix M,
+ * are approximated by a sum of sepRank products of a column
+ * vector by a row vector. Each product is the dominant singular pair
+ * of what remains of M, found by power iteration. We stop as soon as
+ * the relative error is below filterSeparableTolerance. The separable
+ * form is kept only if convolving with it is at least twice cheaper
+ * than with the whole filter, pixels at 128 being free for the direct
+ * convolution.
+ * @param f filter to analyze.
+ */
+void filterUpdateSeparable(Filter*f) {
+    free(f->sepCol);
+    free(f->sepRow);
+    f->sepCol=NULL;
+    f->sepRow=NULL;
+    f->sepRank=0;
+    int w=f->img->width;
+    int h=f->img->height;
+    // maximum rank for which the separable form could be worth it
+    int maxRank=w*h/(2*FILTER_SEPARABLE_COST*(w+h));
+    if (filterForceExact || maxRank<1) return;
+    double * r = (double*)malloc(sizeof(double)*w*h);
+    double total=0;
+    for (int i=0;i<w*h;++i) {
+        r[i]=f->img->data[i]-128;
+        total+=r[i]*r[i];
+    }
+    if (total==0) {
+        free(r);
+        return;
+    }
+    double * col = (double*)malloc(sizeof(double)*h*maxRank);
+    double * row = (double*)malloc(sizeof(double)*w*maxRank);
+    double * t = (double*)malloc(sizeof(double)*w);
+    int rank=0;
+    double error=total;
+    while (rank<maxRank &&
+           error>filterSeparableTolerance*filterSeparableTolerance*total) {
+        double * u = &col[h*rank];
+        double * v = &row[w*rank];
+        // start from the row of r with the largest norm
+        int best=0;
+        double bestNorm=-1;
+        for (int y=0;y<h;++y) {
+            double n=0;
+            for (int x=0;x<w;++x) n+=r[x+w*y]*r[x+w*y];
+            if (n>bestNorm) { bestNorm=n; best=y; }
+        }
+        for (int x=0;x<w;++x) v[x]=r[x+w*best];
+        for (int it=0;it<100;++it) {
+            // u = r v, then v = transpose(r) u normalized
+            for (int y=0;y<h;++y) {
+                u[y]=0;
+                for (int x=0;x<w;++x) u[y]+=r[x+w*y]*v[x];
+            }
+            double n=0,moved=0;
+            for (int x=0;x<w;++x) {
+                t[x]=0;
+                for (int y=0;y<h;++y) t[x]+=r[x+w*y]*u[y];
+                n+=t[x]*t[x];
+            }
+            n=sqrt(n);
+            if (n==0) break;
+            for (int x=0;x<w;++x) {
+                moved+=fabs(t[x]/n-v[x]);
+                v[x]=t[x]/n;
+            }
+            if (moved<1e-12) break;
+        }
+        // u = r v with v of norm 1 holds the singular value
+        for (int y=0;y<h;++y) {
+            u[y]=0;
+            for (int x=0;x<w;++x) u[y]+=r[x+w*y]*v[x];
+        }
+        error=0;
+        for (int y=0;y<h;++y) {
+            for (int x=0;x<w;++x) {
+                r[x+w*y]-=u[y]*v[x];
+                error+=r[x+w*y]*r[x+w*y];
+            }
+        }
+        ++rank;
+    }
+    // cost of the direct convolution: one per non null tap, cost of
+    // the separable form: FILTER_SEPARABLE_COST per non null value
+    // of each vector.
+    long int direct=0,separable=0;
+    for (int i=0;i<w*h;++i) {
+        if (f->img->data[i]!=128) direct++;
+    }
+    for (int i=0;i<h*rank;++i) {
+        if (fabs(col[i])>1e-9) separable+=FILTER_SEPARABLE_COST;
+    }
+    for (int i=0;i<w*rank;++i) {
+        if (fabs(row[i])>1e-9) separable+=FILTER_SEPARABLE_COST;
+    }
+    if (error<=filterSeparableTolerance*filterSeparableTolerance*total &&
+        2*separable<=direct) {
+        f->sepRank=rank;
+        f->sepCol=(float*)malloc(sizeof(float)*h*rank);
+        f->sepRow=(float*)malloc(sizeof(float)*w*rank);
+        for (int i=0;i<h*rank;++i) f->sepCol[i]=col[i];
+        for (int i=0;i<w*rank;++i) f->sepRow[i]=row[i];
+    }
+    free(col);
+    free(row);
+    free(t);
+    free(r);
 }
 
 /**
@@ -88,7 +310,8 @@ void filterUpdateValues(Filter*f) {
  * @param f filter to save.
  * @param basename the base name for files to save.
  *        Files basename+'.png' and basename+'.txt'
- *        are going to be created.
+ *        are going to be created, with basename+'.tensor' which
+ *        newFilterRead maps instead of reading the two others.
  * @see newFilterRead
  */
 void filterWrite(Filter*f,char*basename) {
@@ -104,19 +327,34 @@ void filterWrite(Filter*f,char*basename) {
     fprintf(fi,"%d\n",f->percent);
     fprintf(fi,"%s\n",f->data);
     fclose(fi);
+    char png[99];
+    snprintf(png,99,"%s.png",basename);
+    snprintf(s,99,"%s.tensor",basename);
+    tensorWriteFilter(f,s,png);
 }
 
 /**
  * @brief Reads a filter from the file system
  * @param basename the base name for files to read.
- *        Files basename+'.png' and basename+'.txt'
- *        are expected to be found.
+ *        File basename+'.tensor' is mapped when it exists and
+ *        basename+'.png' did not change since it was written, files
+ *        basename+'.png' and basename+'.txt' are expected to be
+ *        found otherwise.
  * @return the newly created Filter object from data read.
  * @see filterWrite
  */
 Filter * newFilterRead(char *basename) {
-    Filter * answer = (Filter*) malloc(sizeof(struct filter));
     char s[99];
+    snprintf(s,99,"%s.tensor",basename);
+    TensorMap * map = newTensorMapFound(s);
+    if (map!=NULL) {
+        snprintf(s,99,"%s.png",basename);
+        Filter * answer =
+            tensorIsStale(map,0,s)?NULL:tensorMapFilter(map,0);
+        deleteTensorMap(map);
+        if (answer!=NULL) return answer;
+    }
+    Filter * answer = newFilter(NULL,0);
     // read the picture part
     snprintf(s,99,"%s.png",basename);
     answer->img=newImgRead(s);
@@ -19,6 +19,23 @@ struct filter {
     int percent;
     /** data associated with this filter if any. */
     char * data;
+    /** rank of the separable form of the filter, 0 if it has none */
+    int sepRank;
+    /** sepRank vertical vectors of img->height values */
+    float * sepCol;
+    /** sepRank horizontal vectors of img->width values */
+    float * sepRow;
+    /** taps of the filter, built when first needed by filterGetTaps:
+        pixels in taps[0], pixels minus 128 in taps[1] */
+    short * taps[2];
+    /** 255 times the sum of the absolute values of taps[diff] */
+    long int tapBound[2];
+    /** number of non null values in taps[diff] */
+    long int tapCount[2];
+    /** fixed point reciprocal of maxVal-threshold, 0 if not usable */
+    unsigned long long int rescaleMul;
+    /** shift applied after a multiplication by rescaleMul */
+    int rescaleShift;
 };
 
 
@@ -27,10 +44,15 @@ struct filter {
  */
 typedef struct filter Filter;
 
+extern int filterForceExact;
+extern double filterSeparableTolerance;
+
 Filter * newFilter(Img*,int);
 Filter * newFilterRead(char *basename);
 void deleteFilter(Filter*);
 void filterSetWeight(Filter*f,int w);
 void filterUpdateValues(Filter*);
+void filterUpdateSeparable(Filter*);
+const short * filterGetTaps(Filter*f,int diff);
 void filterWrite(Filter*f,char*basename);
 #endif
@@ -1,6 +1,44 @@
+#include <stdint.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 #include "filterfam.h"
 #include "imgfam.h"
+#include "conv.h"
+#include "pool.h"
+#include "tensor.h"
+
+/**
+ * @brief Name of the bank file looked for in the directory of a
+ *        familly by filterFamRead and filterFamCount. A bank holds all
+ *        the families of its directory and is mapped once.
+ *
+ * When left to NULL the environment variable CNN_FILTER_BANK is
+ * looked at, then FILTER_FAM_BANK_NAME is used. An empty name disables
+ * banks, families are then read from their png files.
+ * @see filterFamPack
+ */
+char * filterFamBankName=NULL;
+
+/** default name of the bank file of a directory */
+#define FILTER_FAM_BANK_NAME "filters.tensor"
+
+/**
+ * @brief A directory and its bank, once looked for.
+ */
+struct filterFamBank {
+    /** the directory */
+    char * dir;
+    /** the bank, NULL if the directory has none */
+    TensorMap * map;
+    /** next directory looked at */
+    struct filterFamBank * next;
+};
+
+/** directories looked at so far */
+static struct filterFamBank * filterFamBanks=NULL;
+/** protects filterFamBanks */
+static pthread_mutex_t filterFamBanksLock=PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * @brief creates a a new familly of filters.
@@ -29,14 +67,131 @@ void deleteFilterFam(FilterFam * ff) {
     free(ff);
 }
 
+/**
+ * @brief Gets the name of the bank files.
+ * @return the name, NULL if banks are not used.
+ */
+static char * filterFamGetBankName() {
+    if (filterFamBankName==NULL) {
+        char * e = getenv("CNN_FILTER_BANK");
+        filterFamBankName=(e!=NULL)?e:FILTER_FAM_BANK_NAME;
+    }
+    return filterFamBankName[0]?filterFamBankName:NULL;
+}
+
+/**
+ * @brief Splits the base name of a familly in its directory and the
+ *        name of the familly in the bank.
+ * @param basename base name of the familly.
+ * @param dir where the directory is written.
+ * @param size size of dir.
+ * @return the name of the familly, in basename.
+ */
+static char * filterFamSplit(char * basename,char * dir,size_t size) {
+    char * slash = strrchr(basename,'/');
+    if (slash==NULL) {
+        snprintf(dir,size,".");
+        return basename;
+    }
+    snprintf(dir,size,"%.*s",slash==basename?1:(int)(slash-basename),
+             basename);
+    return slash+1;
+}
+
+/**
+ * @brief Gets the bank of the directory of a familly, mapping it the
+ *        first time the directory is looked at.
+ * @param basename base name of the familly.
+ * @param name where the name of the familly in the bank is written.
+ * @return the bank, to be released with deleteTensorMap, NULL if the
+ *         directory has none.
+ */
+static TensorMap * filterFamGetBank(char * basename,char ** name) {
+    char * bankName = filterFamGetBankName();
+    if (bankName==NULL) return NULL;
+    char dir[1024];
+    *name=filterFamSplit(basename,dir,sizeof(dir));
+    pthread_mutex_lock(&filterFamBanksLock);
+    struct filterFamBank * b = filterFamBanks;
+    while (b!=NULL && strcmp(b->dir,dir)!=0) b=b->next;
+    if (b==NULL) {
+        char path[strlen(dir)+strlen(bankName)+2];
+        snprintf(path,sizeof(path),"%s/%s",dir,bankName);
+        b=(struct filterFamBank*)malloc(sizeof(struct filterFamBank));
+        b->dir=stringCopy(dir);
+        b->map=tensorIsFile(path)?newTensorMap(path):NULL;
+        b->next=filterFamBanks;
+        filterFamBanks=b;
+    }
+    TensorMap * answer = b->map;
+    if (answer!=NULL) __atomic_add_fetch(&answer->refs,1,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&filterFamBanksLock);
+    return answer;
+}
+
+/**
+ * @brief Forgets the bank of a directory, so that it is looked for
+ *        again. Filters already mapped from it are kept.
+ * @param dir the directory.
+ */
+static void filterFamForgetBank(char * dir) {
+    pthread_mutex_lock(&filterFamBanksLock);
+    struct filterFamBank ** b = &filterFamBanks;
+    while (*b!=NULL && strcmp((*b)->dir,dir)!=0) b=&(*b)->next;
+    if (*b!=NULL) {
+        struct filterFamBank * old = *b;
+        *b=old->next;
+        deleteTensorMap(old->map);
+        free(old->dir);
+        free(old);
+    }
+    pthread_mutex_unlock(&filterFamBanksLock);
+}
+
+/**
+ * @brief Looks for a familly in a bank.
+ *
+ * The familly is stale, and not used, when the png file of one of its
+ * filters changed since the bank was written or when it has more png
+ * files than filters in the bank, see tensorFamilyIsStale. The png
+ * files are only looked at when the directory changed since the bank
+ * was written, and once per bank mapped.
+ * @param bank the bank of the directory of the familly.
+ * @param basename base name of the familly.
+ * @param name name of the familly in the bank.
+ * @param count where the number of filters of the familly is written.
+ * @return index of the first record of the familly, -1 if the bank
+ *         has no such familly or if it is stale.
+ */
+static int filterFamFindInBank(TensorMap * bank,
+                               char * basename,
+                               char * name,
+                               int * count)
+{
+    int first = tensorFindFamily(bank,name,count);
+    if (first<0 || tensorFamilyIsStale(bank,first,*count,basename))
+        return -1;
+    return first;
+}
+
 /**
  * @brief counts the number of filters present in familly with prefix
  *        convFilterLoc
+ *
+ * The bank of the directory is looked at first, see filterFamRead.
  * @param convFilterLoc a string to be used as a base for the name of
  *        the picture : convFilterLoc_<num>.png
  * @return number of elements in this filter
  */
 int filterFamCount(char * convFilterLoc) {
+    char * name;
+    TensorMap * bank = filterFamGetBank(convFilterLoc,&name);
+    if (bank!=NULL) {
+        int count;
+        int found = filterFamFindInBank(bank,convFilterLoc,name,&count)>=0;
+        deleteTensorMap(bank);
+        if (found) return count;
+    }
     int answer =-1;
     char fname[strlen(convFilterLoc)+10];
     do {
@@ -61,24 +216,158 @@ void filterFamSetFilter(FilterFam*filterFam,int i,Filter*filter) {
 }
 
 /**
- * @brief Apply all filter of the familly on an image with 
- *        a positive convolution.
+ * @brief Apply one filter on an image.
+ * @param img the image on which to apply the filter.
+ * @param filter the filter to apply.
+ * @param diff same meaning as in convApply.
+ * @param sameSize same meaning as in convApply.
+ * @return the newly allocated resulting image.
+ */
+static Img * filterFamConvolution(Img*img,Filter*filter,int diff,int sameSize) {
+    if (sameSize)
+        return diff?imgConvolutionSameSizeDiff(img,filter)
+            :imgConvolutionSameSize(img,filter);
+    return diff?imgConvolutionDiff(img,filter):imgConvolution(img,filter);
+}
+
+/**
+ * @brief What the tasks of filterFamApply share.
+ */
+struct filterFamTask {
+    /** the image on which to apply the filters */
+    Img * img;
+    /** same meaning as in convApply */
+    int diff;
+    /** same meaning as in convApply */
+    int sameSize;
+    /** filters to apply */
+    Filter ** filters;
+    /** index in answer of the result of each filter */
+    int * idx;
+    /** number of filters */
+    int count;
+    /** spectrum of img when the Fourier transform is used */
+    ConvSpectrum * spectrum;
+    /** where results are written */
+    ImgFam * answer;
+};
+
+/**
+ * @brief Applies one filter of filterFamApply.
+ * @param arg a struct filterFamTask.
+ * @param j index of the filter.
+ */
+static void filterFamConvolutionTask(void*arg,int j) {
+    struct filterFamTask * t = (struct filterFamTask*)arg;
+    imgFamSetImg(t->answer,t->idx[j],
+                 filterFamConvolution(t->img,t->filters[j],
+                                      t->diff,t->sameSize));
+}
+
+/**
+ * @brief Applies a pair of filters of filterFamApply with the
+ *        Fourier transform.
+ * @param arg a struct filterFamTask.
+ * @param j index of the pair.
+ */
+static void filterFamSpectrumTask(void*arg,int j) {
+    struct filterFamTask * t = (struct filterFamTask*)arg;
+    Img * a=NULL;
+    Img * b=NULL;
+    int second=2*j+1<t->count;
+    convApplySpectrum(t->spectrum,t->filters[2*j],
+                      second?t->filters[2*j+1]:NULL,
+                      t->diff,&a,&b);
+    imgFamSetImg(t->answer,t->idx[2*j],a);
+    if (second)
+        imgFamSetImg(t->answer,t->idx[2*j+1],b);
+}
+
+/**
+ * @brief Apply all filter of the familly on an image.
+ *
+ * When all filters have the same size and the cost model of
+ * convUseFft says so, the Fourier transform of the image is computed
+ * once and used for every filter which has no separable form.
+ * Otherwise, if convUseWinograd or convUseGemm says so, these filters
+ * are applied together by convApplyWinograd or convApplyFamily.
+ * Filters are applied in parallel by poolFor.
  * @param filters the familly of filters to apply.
  * @param img the image on which to apply these filters
- * @param the filters to apply.
+ * @param diff same meaning as in convApply.
+ * @param sameSize same meaning as in convApply.
  * @return the newly created familly of resulting images.
  */
-ImgFam * filterFamApplyConvolution(FilterFam* filters,Img* img) {
+static ImgFam * filterFamApply(FilterFam* filters,Img* img,
+                               int diff,int sameSize)
+{
     ImgFam * answer = newImgFam (filters->count);
+    if (filters->count==0) return answer;
+    Filter * pending[filters->count];
+    int pendingIdx[filters->count];
+    int pendingCount=0;
+    int sameFilterSize=1;
     for (int i=0;i<filters->count;++i) {
-        if (filters->filters[i]==NULL) {
+        Filter * f = filters->filters[i];
+        if (f==NULL) {
             ERROR("Not all filters in familly have been initialized.","");
         }
-        imgFamSetImg(answer,i,imgConvolution(img,filters->filters[i]));
+        if (f->img->width!=filters->filters[0]->img->width ||
+            f->img->height!=filters->filters[0]->img->height)
+            sameFilterSize=0;
+        if (!(diff && f->sepRank>0 && !filterForceExact)) {
+            pending[pendingCount]=f;
+            pendingIdx[pendingCount++]=i;
+        }
     }
+    struct filterFamTask t = {img,diff,sameSize,pending,pendingIdx,
+                              pendingCount,NULL,answer};
+    if (sameFilterSize && pendingCount>0 &&
+        convUseFft(img->width,img->height,pending[0],diff,sameSize,
+                   pendingCount)) {
+        t.spectrum = newConvSpectrum(img,pending[0]->img->width,
+                                     pending[0]->img->height,
+                                     sameSize);
+        poolFor((pendingCount+1)/2,filterFamSpectrumTask,&t);
+        deleteConvSpectrum(t.spectrum);
+    } else if (sameFilterSize && pendingCount>0 &&
+               convUseWinograd(pending,pendingCount)) {
+        Img * out[pendingCount];
+        convApplyWinograd(img,pending,pendingCount,diff,sameSize,out);
+        for (int j=0;j<pendingCount;++j) {
+            imgFamSetImg(answer,pendingIdx[j],out[j]);
+        }
+    } else if (sameFilterSize && convUseGemm(pending,pendingCount,diff)) {
+        Img * out[pendingCount];
+        convApplyFamily(img,pending,pendingCount,diff,sameSize,out);
+        for (int j=0;j<pendingCount;++j) {
+            imgFamSetImg(answer,pendingIdx[j],out[j]);
+        }
+    }
+    // every filter not applied yet is applied on its own
+    t.count=0;
+    for (int i=0;i<filters->count;++i) {
+        if (answer->imgs[i]==NULL) {
+            pending[t.count]=filters->filters[i];
+            pendingIdx[t.count++]=i;
+        }
+    }
+    poolFor(t.count,filterFamConvolutionTask,&t);
     return answer;
 }
 
+/**
+ * @brief Apply all filter of the familly on an image with 
+ *        a positive convolution.
+ * @param filters the familly of filters to apply.
+ * @param img the image on which to apply these filters
+ * @param the filters to apply.
+ * @return the newly created familly of resulting images.
+ */
+ImgFam * filterFamApplyConvolution(FilterFam* filters,Img* img) {
+    return filterFamApply(filters,img,0,0);
+}
+
 /**
  * @brief Apply all filter of the familly on an image.
  * @param filters the familly of filters to apply.
@@ -87,14 +376,7 @@ ImgFam * filterFamApplyConvolution(FilterFam* filters,Img* img) {
  * @return the newly created familly of resulting images.
  */
 ImgFam * filterFamApplyConvolutionDiff(FilterFam* filters,Img* img) {
-    ImgFam * answer = newImgFam (filters->count);
-    for (int i=0;i<filters->count;++i) {
-        if (filters->filters[i]==NULL) {
-            ERROR("Not all filters in familly have been initialized.","");
-        }
-        imgFamSetImg(answer,i,imgConvolutionDiff(img,filters->filters[i]));
-    }
-    return answer;
+    return filterFamApply(filters,img,1,0);
 }
 
 /**
@@ -106,14 +388,7 @@ ImgFam * filterFamApplyConvolutionDiff(FilterFam* filters,Img* img) {
  * @return the newly created familly of resulting images.
  */
 ImgFam * filterFamApplyConvolutionSameSize(FilterFam* filters,Img* img) {
-    ImgFam * answer = newImgFam (filters->count);
-    for (int i=0;i<filters->count;++i) {
-        if (filters->filters[i]==NULL) {
-            ERROR("Not all filters in familly have been initialized.","");
-        }
-        imgFamSetImg(answer,i,imgConvolutionSameSize(img,filters->filters[i]));
-    }
-    return answer;
+    return filterFamApply(filters,img,0,1);
 }
 
 
@@ -126,14 +401,7 @@ ImgFam * filterFamApplyConvolutionSameSize(FilterFam* filters,Img* img) {
  * @return the newly created familly of resulting images.
  */
 ImgFam * filterFamApplyConvolutionSameSizeDiff(FilterFam* filters,Img* img) {
-    ImgFam * answer = newImgFam (filters->count);
-    for (int i=0;i<filters->count;++i) {
-        if (filters->filters[i]==NULL) {
-            ERROR("Not all filters in familly have been initialized.","");
-        }
-        imgFamSetImg(answer,i,imgConvolutionSameSizeDiff(img,filters->filters[i]));
-    }
-    return answer;
+    return filterFamApply(filters,img,1,1);
 }
 
 /**
@@ -154,6 +422,187 @@ ImgFam * filterFamApplyConvolutionOnFam(FilterFam* filters,ImgFam* imgFam) {
     return answer;
 }
 
+/**
+ * @brief What the tasks of filterFamApplyConvolutionSameSizeDiffMax
+ *        share.
+ */
+struct filterFamReduceTask {
+    /** filters to apply */
+    FilterFam * filters;
+    /** image on which filters are applied */
+    Img * img;
+    /** size of the square on which the maximum is computed */
+    int poolsize;
+    /** number of pixels between two squares */
+    int stride;
+    /** running maximum, NULL until the first filter is done */
+    Img * answer;
+    /** protects answer */
+    pthread_mutex_t lock;
+};
+
+/**
+ * @brief Applies one filter, down samples the result, then folds its
+ *        luminosity scaled pixels into the running maximum.
+ * @param arg a struct filterFamReduceTask.
+ * @param i index of the filter.
+ */
+static void filterFamReduceTaskRun(void*arg,int i) {
+    struct filterFamReduceTask * t = (struct filterFamReduceTask*)arg;
+    Img * pooled = convApplyMaxPool(t->img,t->filters->filters[i],1,1,
+                                    t->poolsize,t->stride);
+    unsigned char lut[256];
+    imgLuminosityLut(pooled,lut);
+    pthread_mutex_lock(&t->lock);
+    if (t->answer==NULL)
+        t->answer=newImgColor(pooled->width,pooled->height,0);
+    unsigned char * out = t->answer->data;
+    for (int k=0;k<pooled->width*pooled->height;++k) {
+        unsigned char v=lut[pooled->data[k]];
+        if (v>out[k]) out[k]=v;
+    }
+    pthread_mutex_unlock(&t->lock);
+    deleteImg(pooled);
+}
+
+/**
+ * @brief Apply all filters of the familly on an image keeping its
+ *        size, then down sample, spread luminosity and keep the
+ *        maximum over the familly.
+ *
+ * Gives the same image as imgFamMaxAllFam on imgFamLuminosityScale on
+ * imgFamDownSampleMax on filterFamApplyConvolutionSameSizeDiff, but
+ * each filter is applied by convApplyMaxPool, which never holds the
+ * image at full size, and its result is folded into a single running
+ * maximum as soon as it is done. Filters are applied in parallel by
+ * poolFor, so at most one down sampled image per thread is kept.
+ * @param filters the familly of filters to apply.
+ * @param img the image on which to apply these filters.
+ * @param poolsize size of the square on which the maximum is computed.
+ * @param stride number of pixels between two squares.
+ * @return the newly allocated maximum.
+ */
+Img * filterFamApplyConvolutionSameSizeDiffMax(FilterFam* filters,
+                                               Img* img,
+                                               int poolsize,
+                                               int stride)
+{
+    if (filters->count==0)
+        ERROR("Empty familly of filters.","");
+    struct filterFamReduceTask t;
+    t.filters=filters;
+    t.img=img;
+    t.poolsize=poolsize;
+    t.stride=stride;
+    t.answer=NULL;
+    pthread_mutex_init(&t.lock,NULL);
+    poolFor(filters->count,filterFamReduceTaskRun,&t);
+    pthread_mutex_destroy(&t.lock);
+    return t.answer;
+}
+
+/**
+ * @brief What the tasks of filterFamApplyConvolutionMaxPoolOnFam share.
+ */
+struct filterFamPoolTask {
+    /** filters to apply */
+    FilterFam * filters;
+    /** images on which filters are applied */
+    ImgFam * imgFam;
+    /** size of the square on which the maximum is computed */
+    int poolsize;
+    /** number of pixels between two squares */
+    int stride;
+    /** where results are written */
+    ImgFam * answer;
+};
+
+/**
+ * @brief Applies one filter on one image of
+ *        filterFamApplyConvolutionMaxPoolOnFam.
+ * @param arg a struct filterFamPoolTask.
+ * @param idx index of the result, j+i*imgFam->count for filter i and
+ *        image j.
+ */
+static void filterFamPoolTaskRun(void*arg,int idx) {
+    struct filterFamPoolTask * t = (struct filterFamPoolTask*)arg;
+    int i=idx/t->imgFam->count;
+    int j=idx%t->imgFam->count;
+    imgFamSetImg(t->answer,idx,
+                 imgConvolutionMaxPool(t->imgFam->imgs[j],
+                                       t->filters->filters[i],
+                                       t->poolsize,t->stride));
+}
+
+/**
+ * @brief Applies all filters on one image of
+ *        filterFamApplyConvolutionMaxPoolOnFam with convApplyWinograd,
+ *        then pools the results.
+ * @param arg a struct filterFamPoolTask.
+ * @param j index of the image.
+ */
+static void filterFamWinogradPoolTaskRun(void*arg,int j) {
+    struct filterFamPoolTask * t = (struct filterFamPoolTask*)arg;
+    int count=t->filters->count;
+    Img * out[count];
+    convApplyWinograd(t->imgFam->imgs[j],t->filters->filters,count,0,0,out);
+    for (int i=0;i<count;++i) {
+        imgFamSetImg(t->answer,j+i*t->imgFam->count,
+                     imgDownSampleMax(out[i],t->poolsize,t->stride));
+        deleteImg(out[i]);
+    }
+}
+
+/**
+ * @brief Apply all filter of the familly on a familly of images with
+ *        a positive convolution followed by a max pooling.
+ *
+ * Same as imgFamDownSampleMax on the result of
+ * filterFamApplyConvolutionOnFam, without the full size intermediate
+ * images unless convUseWinograd says the filters should be applied
+ * together.
+ * @param filters the familly of filters to apply.
+ * @param imgFam the images on which to apply these filters.
+ * @param poolsize size of the square on which the maximum is computed.
+ * @param stride number of pixels between two squares.
+ * @return the newly created familly of resulting images, the result of
+ *         filter i on image j is at index j+i*imgFam->count.
+ * @see imgConvolutionMaxPool
+ */
+ImgFam * filterFamApplyConvolutionMaxPoolOnFam(FilterFam* filters,
+                                               ImgFam* imgFam,
+                                               int poolsize,
+                                               int stride)
+{
+    ImgFam * answer = newImgFam (filters->count*imgFam->count);
+    struct filterFamPoolTask t = {filters,imgFam,poolsize,stride,answer};
+    if (filters->count>0 && convUseWinograd(filters->filters,filters->count))
+        poolFor(imgFam->count,filterFamWinogradPoolTaskRun,&t);
+    else
+        poolFor(filters->count*imgFam->count,filterFamPoolTaskRun,&t);
+    return answer;
+}
+
+/**
+ * @brief Apply all filter of the familly on an image with a positive
+ *        convolution followed by a max pooling.
+ * @param filters the familly of filters to apply.
+ * @param img the image on which to apply these filters.
+ * @param poolsize size of the square on which the maximum is computed.
+ * @param stride number of pixels between two squares.
+ * @return the newly created familly of resulting images.
+ * @see filterFamApplyConvolutionMaxPoolOnFam
+ */
+ImgFam * filterFamApplyConvolutionMaxPool(FilterFam* filters,
+                                          Img* img,
+                                          int poolsize,
+                                          int stride)
+{
+    ImgFam one = {1,&img};
+    return filterFamApplyConvolutionMaxPoolOnFam(filters,&one,
+                                                 poolsize,stride);
+}
+
 /**
  * @brief Apply all filter of the familly on a familly of images,
  *        and keep same image size.
@@ -177,6 +626,10 @@ ImgFam * filterFamApplyConvolutionSameSizeOnFam(FilterFam* filters,
 
 /**
  * @brief Saves as png files the image familly.
+ *
+ * The bank of the directory is left as it is and mapped again: the
+ * familly saved is read from its png files until the bank is packed
+ * again.
  * @param filterFam the familly to save.
  * @param basename the base name for all files save. The final
  *   name of each file will be basename_i.png where i
@@ -189,17 +642,19 @@ void filterFamWrite(FilterFam*filterFam,char*basename) {
         snprintf(s,99,"%s_%d",basename,i);
         filterWrite(filterFam->filters[i],s);
     }
+    // the bank found before the png files changed is looked at again
+    char dir[1024];
+    filterFamSplit(basename,dir,sizeof(dir));
+    filterFamForgetBank(dir);
 }
 
 /**
  * @brief Read a set of png files to return a filter familly.
  * @param basename the base name for all files read.
- *   names read have the form basename_i.png where i
- *   is the number of the picture in the familly.
  * @return a newly allocated filter familly.
- * @see imgFamWrite
+ * @see filterFamRead
  */
-FilterFam * filterFamRead(char*basename) {
+static FilterFam * filterFamReadFiles(char*basename) {
     char s[99];
     int count=0;
     int found=1;
@@ -220,3 +675,180 @@ FilterFam * filterFamRead(char*basename) {
     }
     return answer;
 }
+
+/**
+ * @brief Read a filter familly.
+ *
+ * The familly is mapped from the bank of its directory when the bank
+ * holds it and its png files did not change since, so that reading
+ * all the families of a directory maps a single file. It is read from
+ * its png files otherwise.
+ * @param basename the base name for all files read.
+ *   names read have the form basename_i.png where i
+ *   is the number of the picture in the familly.
+ * @return a newly allocated filter familly.
+ * @see imgFamWrite
+ * @see filterFamPack
+ */
+FilterFam * filterFamRead(char*basename) {
+    char * name;
+    TensorMap * bank = filterFamGetBank(basename,&name);
+    if (bank!=NULL) {
+        int count;
+        int first = filterFamFindInBank(bank,basename,name,&count);
+        FilterFam * answer =
+            first>=0?tensorMapFilterFam(bank,first,count):NULL;
+        deleteTensorMap(bank);
+        if (answer!=NULL) return answer;
+    }
+    return filterFamReadFiles(basename);
+}
+
+/**
+ * @brief Compares two strings for qsort.
+ */
+static int filterFamCompareNames(const void * a,const void * b) {
+    return strcmp(*(char*const*)a,*(char*const*)b);
+}
+
+/**
+ * @brief Tells if a directory has a bank.
+ * @param dir the directory.
+ * @return non zero if the directory has a bank.
+ * @see filterFamPack
+ */
+int filterFamHasBank(char * dir) {
+    char * bankName = filterFamGetBankName();
+    if (bankName==NULL) return 0;
+    char path[strlen(dir)+strlen(bankName)+2];
+    snprintf(path,sizeof(path),"%s/%s",dir,bankName);
+    return tensorIsFile(path);
+}
+
+/**
+ * @brief Writes the bank of a directory, holding all the families
+ *        saved by filterFamWrite in the directory.
+ *
+ * A familly is found by the files name_0.png and name_0.txt of its
+ * first filter and is read from its png files.
+ * @param dir the directory.
+ * @return the number of families in the bank.
+ * @see filterFamRead
+ */
+int filterFamPack(char * dir) {
+    char * bankName = filterFamGetBankName();
+    if (bankName==NULL) ERROR("banks disabled by CNN_FILTER_BANK","");
+    DIR * d = opendir(dir);
+    if (d==NULL) ERROR("can't open directory ",dir);
+    int count=0;
+    int size=16;
+    char ** names = (char**)malloc(sizeof(char*)*size);
+    struct dirent * e;
+    while ((e=readdir(d))!=NULL) {
+        size_t n=strlen(e->d_name);
+        if (n<7 || strcmp(e->d_name+n-6,"_0.png")!=0) continue;
+        char path[1024];
+        snprintf(path,sizeof(path),"%s/%.*s_0.txt",dir,(int)(n-6),
+                 e->d_name);
+        if (access(path,F_OK)!=0) continue;
+        if (count==size) {
+            size*=2;
+            names=(char**)realloc(names,sizeof(char*)*size);
+        }
+        names[count]=stringCopy(e->d_name);
+        names[count++][n-6]=0;
+    }
+    closedir(d);
+    qsort(names,count,sizeof(char*),filterFamCompareNames);
+    FilterFam ** fams = (FilterFam**)malloc(sizeof(FilterFam*)*size);
+    int total=0;
+    for (int i=0;i<count;++i) {
+        char basename[1024];
+        snprintf(basename,sizeof(basename),"%s/%s",dir,names[i]);
+        fams[i]=filterFamReadFiles(basename);
+        total+=fams[i]->count;
+    }
+    // png file of each filter, so that the bank tells when they change
+    char ** sources = (char**)malloc(sizeof(char*)*(total>0?total:1));
+    for (int i=0,k=0;i<count;++i) {
+        for (int j=0;j<fams[i]->count;++j,++k) {
+            size_t n=strlen(dir)+strlen(names[i])+32;
+            sources[k]=(char*)malloc(n);
+            snprintf(sources[k],n,"%s/%s_%d.png",dir,names[i],j);
+        }
+    }
+    char path[strlen(dir)+strlen(bankName)+2];
+    snprintf(path,sizeof(path),"%s/%s",dir,bankName);
+    tensorWriteFilterFams(path,count,fams,names,sources);
+    filterFamForgetBank(dir);
+    for (int k=0;k<total;++k) free(sources[k]);
+    free(sources);
+    for (int i=0;i<count;++i) {
+        deleteFilterFam(fams[i]);
+        free(names[i]);
+    }
+    free(fams);
+    free(names);
+    return count;
+}
+
+/**
+ * @brief Writes a filter familly in binary form to an open file.
+ *
+ * The familly is written as its number of filters followed, for each
+ * filter, by its width, height and percent then its pixels row by
+ * row. Integers are written as 32 bits in the byte order of the
+ * machine, so files are meant to be read back on the same machine.
+ * The data field of filters is not saved.
+ * @param filterFam the familly to save.
+ * @param f a file opened for writing.
+ * @return 0 on success, non zero if writing failed.
+ * @see newFilterFamReadStream
+ */
+int filterFamWriteStream(FilterFam*filterFam,FILE*f) {
+    int32_t count=filterFam->count;
+    if (fwrite(&count,sizeof(count),1,f)!=1) return 1;
+    for (int i=0;i<filterFam->count;++i) {
+        Filter * filter = filterFam->filters[i];
+        int32_t header[3]={filter->img->width,
+                           filter->img->height,
+                           filter->percent};
+        if (fwrite(header,sizeof(int32_t),3,f)!=3) return 1;
+        size_t n=(size_t)header[0]*header[1];
+        if (fwrite(filter->img->data,1,n,f)!=n) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a filter familly written by filterFamWriteStream.
+ * @param f a file opened for reading.
+ * @return the newly allocated familly, or NULL if the file ends
+ *         before the familly or does not hold a familly.
+ * @see filterFamWriteStream
+ */
+FilterFam * newFilterFamReadStream(FILE*f) {
+    int32_t count;
+    if (fread(&count,sizeof(count),1,f)!=1 || count<0 || count>(1<<20))
+        return NULL;
+    FilterFam * answer = newFilterFam(count);
+    for (int i=0;i<count;++i) {
+        int32_t header[3];
+        if (fread(header,sizeof(int32_t),3,f)!=3 ||
+            header[0]<1 || header[0]>(1<<15) ||
+            header[1]<1 || header[1]>(1<<15) ||
+            header[2]<-100 || header[2]>100) {
+            deleteFilterFam(answer);
+            return NULL;
+        }
+        Img * img = newImgColor(header[0],header[1],0);
+        size_t n=(size_t)header[0]*header[1];
+        if (fread(img->data,1,n,f)!=n) {
+            deleteImg(img);
+            deleteFilterFam(answer);
+            return NULL;
+        }
+        filterFamSetFilter(answer,i,newFilter(img,header[2]));
+    }
+    return answer;
+}
@@ -31,10 +31,26 @@ ImgFam * filterFamApplyConvolutionSameSize(FilterFam* filters,Img* img);
 ImgFam * filterFamApplyConvolutionSameSizeOnFam(FilterFam* filters,
                                                 ImgFam* imgFam);
 ImgFam * filterFamApplyConvolutionSameSizeDiff(FilterFam* filters,Img* img);
+Img * filterFamApplyConvolutionSameSizeDiffMax(FilterFam* filters,
+                                               Img* img,
+                                               int poolsize,
+                                               int stride);
+ImgFam * filterFamApplyConvolutionMaxPool(FilterFam* filters,
+                                          Img* img,
+                                          int poolsize,
+                                          int stride);
+ImgFam * filterFamApplyConvolutionMaxPoolOnFam(FilterFam* filters,
+                                               ImgFam* imgFam,
+                                               int poolsize,
+                                               int stride);
 void filterFamSetFilter(FilterFam*filterFam,int i,Filter*filter);
 void deleteFilterFam(FilterFam *);
 FilterFam * filterFamRead(char*basename);
 void filterFamWrite(FilterFam*filterFam,char*basename);
 int filterFamCount(char * convFilterLoc);
+int filterFamHasBank(char * dir);
+int filterFamPack(char * dir);
+int filterFamWriteStream(FilterFam*filterFam,FILE*f);
+FilterFam * newFilterFamReadStream(FILE*f);
 
 #endif
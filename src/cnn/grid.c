@@ -1,6 +1,15 @@
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
 #include "filterfam.h"
 #include "filter.h"
+#include "grid.h"
+#include "hough.h"
 #include "imgfam.h"
+#include "pool.h"
+#include "trace.h"
 
 /**
  * @file grid.c
@@ -16,32 +25,131 @@
  */
 
 /**
- * @brief activates debug infos to be printed.
+ * @brief Engine used by gridLocate, one of enum gridEngine.
  */
-int gridDumpDebugInfo=1;
+int gridEngine=GRID_ENGINE_FILTERS;
+
+/**
+ * @brief Number of angles the Hough engine looks at in each direction.
+ */
+#define GRID_HOUGH_ANGLES 21
+
+/**
+ * @brief Largest angle in degrees between a line of the grid and the
+ *        vertical or horizontal. Pictures are deskewed first, but
+ *        lines of a grid seen in perspective are not parallel, so
+ *        more than the gridFilterMaxDegrees of the filters engine.
+ */
+#define GRID_HOUGH_MAX_ANGLE 5
+
+/**
+ * @brief Each of the lines found by the Hough engine must get, in
+ *        average, at least the votes of pixels at houghMinGradient
+ *        along this part of the span of the grid: a span of 320
+ *        pixels needs 10 pixels per line.
+ */
+#define GRID_HOUGH_MIN_PART 32
+
+/**
+ * @brief Smallest side of the level of the pyramid searched by
+ *        gridLocatePyramid, bounds being then refined on the finer
+ *        levels. If 0 or less the search is done on the level asked.
+ */
+int gridCoarseSize=200;
+
+/**
+ * @brief Smallest side of the finest level on which gridLocatePyramid
+ *        looks for the lines of the grid again, in a band of a cell
+ *        around the ones found on the coarser level. On finer levels
+ *        lines only move by GRID_REFINE_BAND pixels.
+ */
+int gridFineSize=400;
+
+/**
+ * @brief Half width in pixels of the band in which gridLocatePyramid
+ *        looks for a line on a level finer than gridFineSize.
+ */
+#define GRID_REFINE_BAND 2
+
+/**
+ * @brief Largest angle in degrees of the rotated bar filters of
+ *        gridGetLayerHoriVertFilters. Pictures are deskewed first, see
+ *        gridEstimateSkew, so a degree on each side is enough.
+ */
+int gridFilterMaxDegrees=1;
+
+/**
+ * @brief Largest skew in degrees looked for by gridEstimateSkew.
+ */
+#define GRID_MAX_SKEW 10
+
+/**
+ * @brief Skews in degrees below this value are not worth a rotation.
+ */
+#define GRID_MIN_SKEW 0.25
+
+/**
+ * @brief Largest change of skew in degrees between two frames looked
+ *        for by gridTrackFrame.
+ */
+#define GRID_TRACK_MAX_SKEW 1
+
+/**
+ * @brief The region searched by gridTrackFrame is the grid of the
+ *        previous frame grown by its size divided by this value on
+ *        each side.
+ */
+#define GRID_TRACK_MARGIN 5
+
+/**
+ * @brief Largest change in percent of the size of the grid between two
+ *        frames looked for by gridTrackFrame.
+ */
+#define GRID_TRACK_SPAN 10
+
+/**
+ * @brief Number of angles and largest angle in degrees the Hough
+ *        engine looks at when tracking a grid.
+ */
+#define GRID_TRACK_HOUGH_ANGLES 5
+#define GRID_TRACK_HOUGH_MAX_ANGLE 1
+
+/**
+ * @brief Smallest side in pixels jpeg frames are decoded at by grid
+ *        --track, see newImgReadScaled.
+ */
+#define GRID_TRACK_DECODE_SIZE 400
+
+/**
+ * @brief Confidence in percent of the reference one below which
+ *        gridTrackFrame searches the whole picture again.
+ */
+#define GRID_TRACK_MIN_CONFIDENCE 60
 
 /**
  * @brief Generates filters for the convolution layer to 
  *        detect Sudoku grids.
  *  
  * This function generates either vertical or horizontal filters
- * which are rotate between -5 and +5 degrees.
+ * which are rotate between -gridFilterMaxDegrees and
+ * +gridFilterMaxDegrees degrees.
  * @param i : if i==0 this is a vertical filter
  *            if i==1 this is an horizontal filter
  * @param l length of the bar
  * @param tmin minimum thickness of the bar
  * @param tmax maximum thickness of the bar
  * @param p filter threshold percentage
+ * @param degreeMax largest angle of the bars in degrees
  * @return the newly allocated filter 
  */
-FilterFam * gridGetLayerHoriVertFilters(int i,
-                                        int l,
-                                        int tmin,
-                                        int tmax,
-                                        int p)
+static FilterFam * gridBuildLayerHoriVertFilters(int i,
+                                                 int l,
+                                                 int tmin,
+                                                 int tmax,
+                                                 int p,
+                                                 int degreeMax)
 {
-    FilterFam * answer=newFilterFam(11);
-    int degreeMax=10;
+    FilterFam * answer=newFilterFam((tmax-tmin+1)*(2*degreeMax+1));
     for (int t=tmin;t<=tmax;++t) {
         for (int degrees=-degreeMax;degrees<=degreeMax;++degrees) {
             Img * filter = newImgVerticalBarInRect(7*t,l,t);
@@ -52,32 +160,274 @@ FilterFam * gridGetLayerHoriVertFilters(int i,
                 rotatedFilter=imgRotate90(filter);
             Img * r = imgRotate(rotatedFilter,degrees);
             Filter * invertedFilter = newFilter(imgInvert(r),p);
-            if (0 && gridDumpDebugInfo) {
-                HERE("layer2 on filter");
-                HERED((int)invertedFilter->weight);
-                HERE("_________");
-                HERED((int)invertedFilter->maxVal);
-            }
+            TRACE(TRACE_ALL,"grid.filter","%d %d %d weight %d maxVal %d",
+                  i,l,degrees,(int)invertedFilter->weight,
+                  (int)invertedFilter->maxVal);
             ///invertedFilter->maxVal/10;
             deleteImg(filter);
             deleteImg(rotatedFilter);
             deleteImg(r);
-            if (gridDumpDebugInfo || l==10) {
-                char filterName[99];
-                snprintf(filterName,99,"%s/grid/grid_filter_%d_%d_%02d",CFG_DATAROOTDIR,i,l,degrees);
-                filterWrite(invertedFilter,filterName);
-            }
-            filterFamSetFilter(answer,degrees+degreeMax,invertedFilter);
+            TRACE_IMG(TRACE_ALL,invertedFilter->img,
+                      "grid_filter_%d_%d_%02d",i,l,degrees);
+            filterFamSetFilter(answer,
+                               (t-tmin)*(2*degreeMax+1)+degrees+degreeMax,
+                               invertedFilter);
         }
     }
     return answer;
 }
 
+/**
+ * @brief File where the filters built by gridGetLayerHoriVertFilters
+ *        are saved, so that later processes read them instead of
+ *        building them again.
+ *
+ * When left to NULL the environment variable CNN_GRID_FILTER_CACHE is
+ * looked at, then CFG_DATAROOTDIR/grid/filters.cache is used. An empty
+ * name disables the file, filters are then only kept in memory.
+ */
+char * gridFilterCacheFile=NULL;
+
+/** number of parameters identifying a bank */
+#define GRID_FILTER_KEY_SIZE 6
+
+/**
+ * @brief A familly of filters built by gridGetLayerHoriVertFilters
+ *        and the parameters it was built with.
+ */
+struct gridFilterBank {
+    /** parameters of gridGetLayerHoriVertFilters: i, l, tmin, tmax
+        and p, then gridFilterMaxDegrees */
+    int32_t key[GRID_FILTER_KEY_SIZE];
+    /** the filters */
+    FilterFam * filters;
+    /** next bank of the cache */
+    struct gridFilterBank * next;
+};
+
+/** banks built or read so far */
+static struct gridFilterBank * gridFilterBanks=NULL;
+/** non zero once the cache file has been read */
+static int gridFilterBanksLoaded=0;
+/** protects gridFilterBanks and the cache file */
+static pthread_mutex_t gridFilterBanksLock=PTHREAD_MUTEX_INITIALIZER;
+
+/** first bytes of a cache file */
+#define GRID_FILTER_CACHE_MAGIC "cnn grid filters 2\n"
+
+/**
+ * @brief Gets the name of the cache file.
+ * @return the name, NULL if there is no cache file.
+ */
+static char * gridGetFilterCacheFile() {
+    static char defaultName[]=CFG_DATAROOTDIR "/grid/filters.cache";
+    if (gridFilterCacheFile==NULL) {
+        char * e = getenv("CNN_GRID_FILTER_CACHE");
+        gridFilterCacheFile=(e!=NULL)?e:defaultName;
+    }
+    return gridFilterCacheFile[0]?gridFilterCacheFile:NULL;
+}
+
+/**
+ * @brief Looks for a bank in the cache, gridFilterBanksLock held.
+ * @param key parameters of the bank.
+ * @return the filters of the bank, NULL if not found.
+ */
+static FilterFam * gridFindFilterBank(int32_t*key) {
+    for (struct gridFilterBank*b=gridFilterBanks;b!=NULL;b=b->next) {
+        if (memcmp(b->key,key,sizeof(b->key))==0)
+            return b->filters;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds a bank to the cache, gridFilterBanksLock held.
+ * @param key parameters of the bank.
+ * @param filters the filters of the bank, now owned by the cache.
+ */
+static void gridAddFilterBank(int32_t*key,FilterFam*filters) {
+    struct gridFilterBank * b =
+        (struct gridFilterBank*)malloc(sizeof(struct gridFilterBank));
+    memcpy(b->key,key,sizeof(b->key));
+    b->filters=filters;
+    b->next=gridFilterBanks;
+    gridFilterBanks=b;
+}
+
+/**
+ * @brief Reads all the banks of the cache file, gridFilterBanksLock
+ *        held.
+ *
+ * Banks already in memory are kept. A file which does not start with
+ * GRID_FILTER_CACHE_MAGIC is ignored, as well as a bank which is not
+ * complete, the file being always written whole by
+ * gridSaveFilterBanks.
+ * @param name name of the cache file.
+ */
+static void gridReadFilterBanks(char * name) {
+    FILE * f = fopen(name,"rb");
+    if (f==NULL) return;
+    char magic[sizeof(GRID_FILTER_CACHE_MAGIC)-1];
+    if (fread(magic,1,sizeof(magic),f)!=sizeof(magic) ||
+        memcmp(magic,GRID_FILTER_CACHE_MAGIC,sizeof(magic))) {
+        WARNING("Not a filter cache file, ignored: ",name);
+        fclose(f);
+        return;
+    }
+    int32_t key[GRID_FILTER_KEY_SIZE];
+    while (fread(key,sizeof(int32_t),GRID_FILTER_KEY_SIZE,f)==
+           GRID_FILTER_KEY_SIZE) {
+        FilterFam * filters = newFilterFamReadStream(f);
+        if (filters==NULL) {
+            WARNING("Truncated filter cache file: ",name);
+            break;
+        }
+        if (gridFindFilterBank(key)==NULL)
+            gridAddFilterBank(key,filters);
+        else
+            deleteFilterFam(filters);
+    }
+    fclose(f);
+}
+
+/**
+ * @brief Reads the cache file the first time a bank is asked for,
+ *        gridFilterBanksLock held.
+ */
+static void gridLoadFilterBanks() {
+    gridFilterBanksLoaded=1;
+    char * name = gridGetFilterCacheFile();
+    if (name!=NULL) gridReadFilterBanks(name);
+}
+
+/**
+ * @brief Saves all the banks to the cache file, gridFilterBanksLock
+ *        held.
+ *
+ * The file is read again first so that the banks other processes
+ * saved meanwhile are kept. The banks are then written to a file
+ * named after the process, which replaces the cache file by a
+ * rename: readers always see a whole file, and processes saving at
+ * the same time can not mix their banks. Two processes saving at the
+ * same time may still lose the bank of the first one, which is then
+ * built again by the next process. Nothing is written if the file can
+ * not be created.
+ */
+static void gridSaveFilterBanks() {
+    char * name = gridGetFilterCacheFile();
+    if (name==NULL) return;
+    gridReadFilterBanks(name);
+    char tmpName[strlen(name)+32];
+    snprintf(tmpName,sizeof(tmpName),"%s.%ld.tmp",name,(long)getpid());
+    FILE * f = fopen(tmpName,"wb");
+    if (f==NULL) return;
+    int failed=fwrite(GRID_FILTER_CACHE_MAGIC,1,
+                      sizeof(GRID_FILTER_CACHE_MAGIC)-1,f)
+        !=sizeof(GRID_FILTER_CACHE_MAGIC)-1;
+    for (struct gridFilterBank*b=gridFilterBanks;
+         b!=NULL && !failed;b=b->next) {
+        failed=fwrite(b->key,sizeof(int32_t),GRID_FILTER_KEY_SIZE,f)
+            !=GRID_FILTER_KEY_SIZE ||
+            filterFamWriteStream(b->filters,f);
+    }
+    if (fclose(f) || failed || rename(tmpName,name)) {
+        WARNING("Could not write filter cache file: ",name);
+        remove(tmpName);
+    }
+}
+
+/**
+ * @brief Gets the filters for the convolution layer to detect Sudoku
+ *        grids.
+ *
+ * Filters are built by gridBuildLayerHoriVertFilters the first time
+ * they are asked for, then kept in memory and saved in the file named
+ * by gridFilterCacheFile, which is read by the first call of later
+ * processes. Threads can call this function at the same time.
+ * @param i : if i==0 this is a vertical filter
+ *            otherwise it is an horizontal one.
+ * @param l length of filter
+ * @param tmin minimum thickness of filter
+ * @param tmax maximum thickness of filter
+ * @param p filter threshold percentage
+ * @return the familly of filters, owned by the cache: it must not be
+ *         modified nor deleted.
+ */
+FilterFam * gridGetLayerHoriVertFilters(int i,
+                                        int l,
+                                        int tmin,
+                                        int tmax,
+                                        int p)
+{
+    int32_t key[GRID_FILTER_KEY_SIZE]={i!=0,l,tmin,tmax,p,
+                                       gridFilterMaxDegrees};
+    pthread_mutex_lock(&gridFilterBanksLock);
+    if (!gridFilterBanksLoaded)
+        gridLoadFilterBanks();
+    FilterFam * answer = gridFindFilterBank(key);
+    pthread_mutex_unlock(&gridFilterBanksLock);
+    if (answer!=NULL) return answer;
+    // built without the lock so that other banks can be built meanwhile
+    FilterFam * built = gridBuildLayerHoriVertFilters(i,l,tmin,tmax,p,
+                                                      gridFilterMaxDegrees);
+    pthread_mutex_lock(&gridFilterBanksLock);
+    answer = gridFindFilterBank(key);
+    if (answer==NULL) {
+        gridAddFilterBank(key,built);
+        gridSaveFilterBanks();
+        answer=built;
+    } else {
+        deleteFilterFam(built);
+    }
+    pthread_mutex_unlock(&gridFilterBanksLock);
+    return answer;
+}
+
+/**
+ * @brief What the two tasks of gridVertHoriConvo share.
+ */
+struct gridConvoTask {
+    /** inputs, vertical one first */
+    Img * input[2];
+    /** outputs, vertical one first */
+    Img * output[2];
+    /** width of convolution */
+    int width;
+    /** length of convolution */
+    int length;
+    /** filter threshold percentage */
+    int threshold;
+    /** pool size to reduce image */
+    int poolsize;
+    /** step to jump to reduce image */
+    int stride;
+};
+
+/**
+ * @brief Performs the vertical (i==0) or horizontal (i==1) part of
+ *        gridVertHoriConvo.
+ * @param arg a struct gridConvoTask.
+ * @param i which part to compute.
+ */
+static void gridVertHoriConvoTask(void*arg,int i) {
+    struct gridConvoTask * t = (struct gridConvoTask*)arg;
+    FilterFam * filters=
+        gridGetLayerHoriVertFilters(i,t->length,t->width,t->width+0,
+                                    t->threshold);
+    // convolution, max pooling, luminosity scaling and maximum over
+    // the familly in a single pass
+    t->output[i]=
+        filterFamApplyConvolutionSameSizeDiffMax(filters,t->input[i],
+                                                 t->poolsize,t->stride);
+}
+
 /**
  * @brief Perform vertical and horizontal convolution.
  *
  * This function should be called several times until convolution
- * only keeps the sudoku grid lines.
+ * only keeps the sudoku grid lines. Both convolutions run in
+ * parallel by poolFor.
  * @param outputH newly allocated image for horizontal convolution.
  * @param outputV newly allocated image for vertical convolution.
  * @param inputH current image for horizontal convolution.
@@ -97,64 +447,168 @@ void gridVertHoriConvo(Img ** outputH,
                        int poolsize,
                        int stride)
 {
-    FilterFam * filtersVert=
-        gridGetLayerHoriVertFilters(0,length,width,width+0,threshold);
-    FilterFam * filtersHori=
-        gridGetLayerHoriVertFilters(1,length,width,width+0,threshold);
-    
-    ImgFam * layerVertOutput =
-        filterFamApplyConvolutionSameSizeDiff(filtersVert,inputV);
-    ImgFam * layerHoriOutput =
-        filterFamApplyConvolutionSameSizeDiff(filtersHori,inputH);
-    deleteFilterFam(filtersVert);
-    deleteFilterFam(filtersHori);
-    
-    ImgFam * layerMaxPoolVertOutput=
-        imgFamDownSampleMax(layerVertOutput,poolsize,stride);
-    ImgFam * layerMaxPoolHoriOutput=
-        imgFamDownSampleMax(layerHoriOutput,poolsize,stride);
-    deleteImgFam(layerVertOutput);
-    deleteImgFam(layerHoriOutput);
-    
-    ImgFam * betterContrastHori2 =
-        imgFamLuminosityScale(layerMaxPoolHoriOutput);
-    ImgFam * betterContrastVert2 =
-        imgFamLuminosityScale(layerMaxPoolVertOutput);
-    deleteImgFam(layerMaxPoolVertOutput);
-    deleteImgFam(layerMaxPoolHoriOutput);
-    
-    if (betterContrastHori2->count!=1 ||
-        betterContrastVert2->count!=1) {
-        //ERROR("Wrong size.","");
+    struct gridConvoTask t = {{inputV,inputH},{NULL,NULL},
+                              width,length,threshold,poolsize,stride};
+    poolFor(2,gridVertHoriConvoTask,&t);
+    *outputV=t.output[0];
+    *outputH=t.output[1];
+}
+
+/**
+ * @brief Time in milliseconds gridIdentifyNPoints may spend, 0 for no
+ *        limit. If negative it is read from CNN_GRID_NPOINTS_BUDGET the
+ *        first time it is needed.
+ */
+int gridNPointsBudgetMs=-1;
+
+/**
+ * @brief Gets the time budget of gridIdentifyNPoints.
+ * @return a number of milliseconds, 0 if there is no limit.
+ */
+static int gridGetNPointsBudget() {
+    if (gridNPointsBudgetMs<0) {
+        char * e = getenv("CNN_GRID_NPOINTS_BUDGET");
+        int v = (e!=NULL)?atoi(e):0;
+        gridNPointsBudgetMs=(v>0)?v:0;
     }
-    // write address the filter to return to caller
-    //*outputV=betterContrastVert2->imgs[0];
-    //*outputH=betterContrastHori2->imgs[0];
-    *outputV=imgFamMaxAllFam(betterContrastVert2);
-    *outputH=imgFamMaxAllFam(betterContrastHori2);
-    // pretend there is no filter in the filterFam
-    //betterContrastHori2->count=0;
-    //betterContrastVert2->count=0;
-    // delete filterFam allocated data
-    deleteImgFam(betterContrastHori2);
-    deleteImgFam(betterContrastVert2);
+    return gridNPointsBudgetMs;
+}
+
+/**
+ * @brief Reads a monotonic clock.
+ * @return a time in milliseconds.
+ */
+static double gridNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e3+ts.tv_nsec*1e-6;
 }
 
-// for debug
-int gridIdentifyNPointsCounter=0;
+/**
+ * @brief What the tasks of gridIdentifyNPoints share.
+ */
+struct gridNPointsTask {
+    /** number of points equaly spaced we are looking for */
+    int N;
+    /** image of n by 1 pixels */
+    Img * img;
+    /** prefix sums of the pixels of img, n+1 values */
+    long int * sum;
+    /** spacings in the order they are scored */
+    int * order;
+    /** time after which spacings are no longer scored, 0 if none */
+    double deadline;
+    /** maximum of the correlation for each spacing, -1 if not scored */
+    int * convVal;
+    /** lower bound found for each spacing */
+    int * lowerBoundOffset;
+    /** upper bound found for each spacing */
+    int * upperBoundOffset;
+};
+
+/**
+ * @brief Scores one spacing of gridIdentifyNPoints.
+ *
+ * The filter of a spacing i is newImgNDotsHori(N,i) inverted, taken
+ * minus 128: it is -128 everywhere but close to the N dots. So the
+ * correlation at offset j is -128 times the sum of the i pixels from
+ * j, read from prefix sums, plus a few taps around each dot. Values
+ * are rescaled as imgConvolutionDiff would do with a threshold of 99
+ * percent, which gives the same result for a fraction of the work.
+ * @param arg a struct gridNPointsTask.
+ * @param k rank of the spacing in t->order.
+ */
+static void gridIdentifyNPointsTask(void*arg,int k) {
+    struct gridNPointsTask * t = (struct gridNPointsTask*)arg;
+    int N=t->N;
+    int i=t->order[k];
+    t->convVal[i]=-1;
+    // the first spacing is always scored so that there is an answer
+    if (k>0 && t->deadline>0 && gridNow()>t->deadline) return;
+    // taps around the dots, computed as in newImgNDotsHori
+    int pos[i];
+    int val[i];
+    int taps=0;
+    float step=((float)i)/((float)N);
+    float stepOverTwo=step/2.;
+    float dmax=3;
+    int x=0;
+    // only pixels closer than dmax+1 to a dot can be darkened
+    for (int m=-1;m<=N;++m) {
+        float center=(double)m*step+stepOverTwo;
+        int end=(int)(center+dmax)+2;
+        if (end>i) end=i;
+        if (x<(int)(center-dmax)-1) x=(int)(center-dmax)-1;
+        if (x<0) x=0;
+        for (;x<end;++x) {
+            float xr = round((x-stepOverTwo)/step)*step+stepOverTwo;
+            float d = fabs(xr-x);
+            if (d<dmax) {
+                pos[taps]=x;
+                val[taps]=255-INBYTE((int)(d*255/dmax));
+                ++taps;
+            }
+        }
+    }
+    // runs of consecutive taps, one or two per dot
+    int runStart[taps];
+    int runEnd[taps];
+    int runs=0;
+    for (int p=0;p<taps;++p) {
+        if (runs>0 && runEnd[runs-1]==pos[p]) {
+            runEnd[runs-1]++;
+        } else {
+            runStart[runs]=pos[p];
+            runEnd[runs]=pos[p]+1;
+            ++runs;
+        }
+    }
+    const unsigned char * data=t->img->data;
+    const long int * sum=t->sum;
+    long int maxVal=255L*i;
+    long int threshold=maxVal*99/100;
+    int localMax=-1;
+    for (int j=0;j+i<=t->img->width;++j) {
+        long int v=-128*(sum[j+i]-sum[j]);
+        // taps are at most 255 so the pixels under them give a bound
+        long int under=0;
+        for (int r=0;r<runs;++r) {
+            under+=sum[j+runEnd[r]]-sum[j+runStart[r]];
+        }
+        int c=0;
+        if (v+255*under>=threshold) {
+            for (int p=0;p<taps;++p) {
+                v+=data[j+pos[p]]*val[p];
+            }
+            if (v<threshold) c=0;
+            else if (v>maxVal) c=255;
+            else c=(255*(v-threshold))/(maxVal-threshold);
+        }
+        if (c>localMax) {
+            localMax=c;
+            t->lowerBoundOffset[i]=j+i/2/N;
+            t->upperBoundOffset[i]=j+i-i/2/N;
+        }
+    }
+    t->convVal[i]=localMax;
+}
 
 /**
  * @brief identify N points equaly spaced in a 
  *        n by 1 pixel image.
  *
- * This function, called from gridLocate, is a simple convolution 
- * with some filters comming from newImgNDotsHori.
+ * This function, called from gridLocate, correlates the image with
+ * the N dots of newImgNDotsHori for every spacing from startRange to
+ * endRange, at most n-2, and keeps the best one. Spacings are scored
+ * in parallel by poolFor, one in 16 first then filling the gaps, so
+ * that when the time budget given by gridNPointsBudgetMs runs out the
+ * spacings scored so far still cover the whole range.
  * @param N number of points equaly spaced we are looking for.
  * @param img an image of n by 1 pixels
- * @param startRange minimum distance in pixel among which the N
- *        points are spread.
- * @param endRange maximum distance in pixel among which the N
- *        points are spread.
+ * @param startRange minimum width in pixels of the N dots, n/2 to
+ *        look at the whole picture.
+ * @param endRange maximum width in pixels of the N dots, n-2 to
+ *        look at the whole picture.
  * @see newImgNDotsHori
  * @see gridLocate
  */
@@ -170,65 +624,62 @@ int gridIdentifyNPoints(int N,
     if (img->height!=1) {
         ERROR("Expected a height of 1","");
     }
-    gridIdentifyNPointsCounter++;
-    Img * imgs[n];
-    int convVal[n];
-    int weight[n];
-    int max=0;
-    int maxIdx=0;
-    int lowerBoundOffset[n];
-    int upperBoundOffset[n];
-    for (int i=n/2;i<n-1;++i) {
-        Img * f1 = newImgNDotsHori(N,i);
-        Filter * f =newFilter(imgInvert(f1),99);
-        deleteImg(f1);
-        if (gridDumpDebugInfo) {
-            char s[99];
-            snprintf(s,99,"conv_filter_%d_%d.png",N,i);
-            imgWrite(f->img,s);
-        }
-        Img * c = imgConvolutionDiff(img,f);
-        weight[i]=f->weight;
-        deleteFilter(f);
-        imgs[i]=c;
-        if (gridDumpDebugInfo) {
-            char s[99];
-            snprintf(s,99,"conv_result_%d_%d.png",gridIdentifyNPointsCounter,i);
-            imgWrite(c,s);
-        }
-        int localMax=-1;
-        for (int j=0;j<c->width;++j) {
-            if (c->data[j]>localMax) {
-                localMax=c->data[j];
-                lowerBoundOffset[i]=j+i/2/N;
-                upperBoundOffset[i]=j+i-i/2/N;
+    *maxCorrelation=0;
+    *lowerBound=0;
+    *upperBound=0;
+    int from=startRange<1?1:startRange;
+    int to=endRange>n-2?n-2:endRange;
+    int count=to-from+1;
+    if (count<=0) return 0;
+    long int * sum=(long int*)malloc(sizeof(long int)*(n+1));
+    int * buffer=(int*)malloc(sizeof(int)*(count+4*n));
+    int * order=buffer;
+    int * convVal=buffer+count;
+    int * lowerBoundOffset=convVal+n;
+    int * upperBoundOffset=lowerBoundOffset+n;
+    int * rank=upperBoundOffset+n;
+    sum[0]=0;
+    for (int x=0;x<n;++x) sum[x+1]=sum[x]+img->data[x];
+    // coarse to fine order of the spacings
+    for (int i=0;i<n;++i) rank[i]=-1;
+    int k=0;
+    for (int s=16;s>0;s/=2) {
+        for (int i=from;i<=to;i+=s) {
+            if (rank[i]<0) {
+                rank[i]=k;
+                order[k++]=i;
             }
         }
-        if (localMax>max) {
-            max=localMax;maxIdx=i;
+    }
+    int budget=gridGetNPointsBudget();
+    struct gridNPointsTask t = {
+        N,img,sum,order,budget>0?gridNow()+budget:0,
+        convVal,lowerBoundOffset,upperBoundOffset};
+    poolFor(count,gridIdentifyNPointsTask,&t);
+    int max=-1;
+    int maxIdx=from;
+    for (int i=from;i<=to;++i) {
+        if (convVal[i]>max) {
+            max=convVal[i];maxIdx=i;
         }
-        convVal[i]=localMax;
     }
-    for (int i=n/2;i<n-1;++i) {
-        if (max-max/20<convVal[i]) {
-            if (gridDumpDebugInfo) {
-                HERE("------------");
-                HERED(convVal[i]);
-                HERED(i);
-                //imgPrint(imgs[i]);
+    if (TRACE_ON(TRACE_DATA)) {
+        for (int i=from;i<=to;++i) {
+            if (convVal[i]>=0 && max-max/20<convVal[i]) {
+                TRACE(TRACE_DATA,"grid.spacing","span %d score %d",
+                      i,convVal[i]);
             }
         }
-        deleteImg(imgs[i]);
     }
     *maxCorrelation=convVal[maxIdx];
     *lowerBound=lowerBoundOffset[maxIdx];
     *upperBound=upperBoundOffset[maxIdx];
+    free(buffer);
+    free(sum);
     return 0;
 }
 
 void gridShowAllLayer1Output(Img * img,char *prefix,char * suffix) {
-    // turn all debug info to false on n, rather
-    gridDumpDebugInfo=0;
     for (int i=200; i>0; i=i-10) {
         printf("generating grid layer 1 output for threshold %d.\n",i);
         Img *layer1HO,*layer1VO;
@@ -252,17 +703,23 @@ void gridShowAllLayer1Output(Img * img,char *prefix,char * suffix) {
 
 Img* gridPreprocessRawPicture(char * imgName, int * scaleFactor,int saveToDisk)
 {
-    Img * rawInputImage=newImgRead(imgName);
+    int scale=1;
+    // jpeg files are decoded at a smaller size when large enough, png
+    // files at their size as cnn does
+    int previewSize=imgReadFormat(imgName)==IMG_FORMAT_JPEG?400:0;
+    Img * rawInputImage=newImgReadScaled(imgName,previewSize,&scale);
     *scaleFactor=0;
+    while (scale>1) {
+        scale/=2;
+        (*scaleFactor)++;
+    }
     while (rawInputImage->width>400 && rawInputImage->height>400) {
         Img * i = imgDivideByTwo(rawInputImage);
         deleteImg(rawInputImage);
         rawInputImage=i;
         (*scaleFactor)++;
     }
-    HERE(":-(");
     if (saveToDisk) {
-        HERE(":-)");
         imgWrite(rawInputImage,
                  "../../doc/explanation/generated/gridLayer0_0.png");
     }
@@ -271,7 +728,15 @@ Img* gridPreprocessRawPicture(char * imgName, int * scaleFactor,int saveToDisk)
         imgWrite(goodContastImage,
                  "../../doc/explanation/generated/gridLayer0_1.png");
     }
-    Img * invertedImage = imgRotate(imgInvert(goodContastImage),-2);
+    Img * invertedImage = imgInvert(goodContastImage);
+    ImgFam * pyramid = newImgFamPyramid(invertedImage,1);
+    double skew=gridEstimateSkew(pyramid);
+    deleteImgFam(pyramid);
+    if (skew!=0) {
+        Img * deskewed = imgRotateBilinear(invertedImage,skew,0);
+        deleteImg(invertedImage);
+        invertedImage=deskewed;
+    }
     if (saveToDisk) {
         imgWrite(invertedImage,
                  "../../doc/explanation/generated/gridLayer0_2.png");
@@ -296,36 +761,60 @@ Img* gridPreprocessRawPicture(char * imgName, int * scaleFactor,int saveToDisk)
 }
 
 /**
- * @brief Locates a sudoku grid in a picture.
+ * @brief What the two tasks of gridLocate share.
+ */
+struct gridLocateTask {
+    /** flattened images, vertical one first */
+    Img * flattened[2];
+    /** same meaning as in gridIdentifyNPoints, for each direction */
+    int startRange[2];
+    /** same meaning as in gridIdentifyNPoints, for each direction */
+    int endRange[2];
+    /** where lower bounds are written */
+    int * lowerBound[2];
+    /** where upper bounds are written */
+    int * upperBound[2];
+    /** where maximum correlations are written */
+    int * maxCorrelation[2];
+};
+
+/**
+ * @brief Looks for the 10 lines of the grid vertically (i==0) or
+ *        horizontally (i==1).
+ * @param arg a struct gridLocateTask.
+ * @param i which direction to look at.
+ */
+static void gridLocateTaskRun(void*arg,int i) {
+    struct gridLocateTask * t = (struct gridLocateTask*)arg;
+    gridIdentifyNPoints(10,t->flattened[i],t->startRange[i],t->endRange[i],
+                        t->lowerBound[i],t->upperBound[i],
+                        t->maxCorrelation[i]);
+}
+
+/**
+ * @brief Locates a sudoku grid in a picture with the rotated bar
+ *        filters, GRID_ENGINE_FILTERS.
  *
  * This function calls gridVertHoriConvo to perform a vertical and
  * horizontal convolution using filters from gridGetLayerHoriVertFilters.
  * The verification that we get 10 lines horizontally or vertically is 
  * performed by calling function gridIdentifyNPoints.
  *
- * This function should not be called on a picture which is too large.
- * Width and height of the picture between 200 and 400 pixels would be 
- * a typical usage.
- *
- * @param img picture in which we are looking.
- * @param xmin pointer to an integer where the horizontal position
- *        of the lower left position of the grid will be written.
- * @param ymin pointer to an integer where the vertical position
- *        of the lower left position of the grid will be written.
- * @param xmax pointer to an integer where the horizontal position
- *        of the upper right position of the grid will be written.
- * @param ymax pointer to an integer where the vertical position
- *        of the upper right position of the grid will be written.
- * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ * The confidence is the smallest of the correlations of both
+ * directions, between 0 and 255.
+ * @see gridLocateSpans
  * @see gridGetLayerHoriVertFilters
  * @see gridVertHoriConvo
  * @see gridIdentifyNPoints
  */
-int gridLocate(Img * img,
-               int * xmin,
-               int * ymin,
-               int * xmax,
-               int * ymax)
+static int gridLocateFilters(Img * img,
+                             const int * minSpan,
+                             const int * maxSpan,
+                             int * xmin,
+                             int * ymin,
+                             int * xmax,
+                             int * ymax,
+                             long int * confidence)
 {
     Img *layer1HO,*layer1VO;
     gridVertHoriConvo(&layer1HO,&layer1VO,
@@ -337,10 +826,8 @@ int gridLocate(Img * img,
                       1,1);
     
     
-    if (gridDumpDebugInfo) {
-        imgWrite(layer1HO,"gridLayer1OutputHori.png");
-        imgWrite(layer1VO,"gridLayer1OutputVert.png");
-    }
+    TRACE_IMG(TRACE_DATA,layer1HO,"gridLayer1OutputHori");
+    TRACE_IMG(TRACE_DATA,layer1VO,"gridLayer1OutputVert");
     Img *layer5HO,*layer5VO;
     layer5HO=layer1HO;
     layer5VO=layer1VO;
@@ -356,13 +843,8 @@ int gridLocate(Img * img,
         else if (s>sumMaxVal) s=255;
         else s=255*(s-sumMinVal)/(sumMaxVal-sumMinVal);
         flattenedVert->data[x]=s;
-        printf("%d ",s);
     }
-    
-    if (gridDumpDebugInfo) {
-        imgWrite(flattenedVert,"gridLayer2OutputVert.png");
-    }
-    printf("\n");
+    TRACE_IMG(TRACE_DATA,flattenedVert,"gridLayer2OutputVert");
     sumMinVal=8*img->width;
     sumMaxVal=128*img->width;
     Img * flattenedHori = newImgColor(layer5VO->height,1,0);
@@ -375,35 +857,28 @@ int gridLocate(Img * img,
         else if (s>sumMaxVal) s=255;
         else s=255*(s-sumMinVal)/(sumMaxVal-sumMinVal);
         flattenedHori->data[y]=s;
-        printf("%d ",s);
     }
-    
-    if (gridDumpDebugInfo) {
-        imgWrite(flattenedHori,"gridLayer2OutputHori.png");
-    }
-    printf("\n");
+    TRACE_IMG(TRACE_DATA,flattenedHori,"gridLayer2OutputHori");
 
-    // the 10 equidistant point should spread on the minimum
-    // between img->width and img->height and that value
-    // divided by 2.
-    int minLength = img->width;
-    if (img->height<minLength) minLength=img->height;
-    int endRange=minLength;
-    int startRange=4*endRange/5;
     int maxCorrelationVer=0;
-    gridIdentifyNPoints(10,flattenedVert,startRange, endRange,xmin,xmax,
-                        &maxCorrelationVer);
-
-    if (gridDumpDebugInfo) {
-        HERE("+++++++++++++++");
-    }
     int maxCorrelationHori=0;
-    gridIdentifyNPoints(10,flattenedHori,startRange, endRange,ymin,ymax,
-                        &maxCorrelationHori);
-    HERE("maxCorrelationHori");
-    HERED(maxCorrelationHori);
-    HERE("maxCorrelationVer");
-    HERED(maxCorrelationVer);
+    struct gridLocateTask t = {
+        {flattenedVert,flattenedHori},
+        {img->width/2,img->height/2},{img->width-2,img->height-2},
+        {xmin,ymin},{xmax,ymax},{&maxCorrelationVer,&maxCorrelationHori}};
+    if (minSpan!=NULL) {
+        // the 10 dots are 10/9 of the distance between the first and
+        // last lines wide
+        for (int dir=0;dir<2;++dir) {
+            t.startRange[dir]=minSpan[dir]*10/9;
+            t.endRange[dir]=(maxSpan[dir]*10+8)/9;
+        }
+    }
+    poolFor(2,gridLocateTaskRun,&t);
+    TRACE(TRACE_INFO,"grid.filters","correlation vertical %d horizontal %d",
+          maxCorrelationVer,maxCorrelationHori);
+    *confidence=maxCorrelationVer<maxCorrelationHori?
+        maxCorrelationVer:maxCorrelationHori;
 
     deleteImg(flattenedVert);
     deleteImg(flattenedHori);
@@ -413,6 +888,712 @@ int gridLocate(Img * img,
     return 0;
 }
 
+/**
+ * @brief Locates a sudoku grid in a picture with a Hough transform,
+ *        GRID_ENGINE_HOUGH.
+ *
+ * The pixels of the picture vote once, given the direction of their
+ * gradient, for lines close to vertical or horizontal. For each
+ * direction the 10 equally spaced lines with the most votes are
+ * looked for at the sharpest angle. Lines are given by their position
+ * in the middle of the picture.
+ *
+ * The confidence is the smallest of the scores of houghFindLines for
+ * both directions. No grid is found when, in a direction, the lines
+ * got no votes or fewer than GRID_HOUGH_MIN_PART allows.
+ * @param angles number of angles looked at in each direction.
+ * @param maxAngle largest angle in degrees looked at.
+ * @return 0 if a grid had been found, 1 otherwise.
+ * @see gridLocateSpans
+ * @see newHough
+ * @see houghFindLines
+ */
+static int gridLocateHough(Img * img,
+                           int angles,
+                           double maxAngle,
+                           const int * minSpan,
+                           const int * maxSpan,
+                           int * xmin,
+                           int * ymin,
+                           int * xmax,
+                           int * ymax,
+                           long int * confidence)
+{
+    Hough * h = newHough(img,angles,maxAngle);
+    int minLength = img->width;
+    if (img->height<minLength) minLength=img->height;
+    int * lowerBound[2]={xmin,ymin};
+    int * upperBound[2]={xmax,ymax};
+    *confidence=-1;
+    int answer=0;
+    for (int dir=0;dir<2;++dir) {
+        int angle=houghBestAngle(h,dir);
+        long int score=houghFindLines(h,dir,angle,10,
+                                      minSpan?minSpan[dir]:minLength/2,
+                                      maxSpan?maxSpan[dir]:
+                                      img->width+img->height,
+                                      lowerBound[dir],upperBound[dir]);
+        if (*confidence<0 || score<*confidence) *confidence=score;
+        int span=*upperBound[dir]-*lowerBound[dir];
+        long int minScore=(long int)
+            (10*sqrt(houghMinGradient*(double)span/GRID_HOUGH_MIN_PART));
+        if (score<=0 || score<minScore) answer=1;
+        if (TRACE_ON(TRACE_DATA)) {
+            Img * profile=houghProfile(h,dir,angle);
+            TRACE_IMG(TRACE_DATA,profile,dir?"gridHoughOutputHori":
+                      "gridHoughOutputVert");
+            deleteImg(profile);
+        }
+        TRACE(TRACE_INFO,"grid.hough",
+              "%s lines: angle %d score %ld (at least %ld)",
+              dir?"horizontal":"vertical",angle,score,minScore);
+    }
+    deleteHough(h);
+    return answer;
+}
+
+/**
+ * @brief Locates a sudoku grid whose size is known roughly in a
+ *        picture.
+ *
+ * The work is done by the engine given by gridEngine.
+ * @param img picture in which we are looking.
+ * @param minSpan for each direction, vertical lines first, the
+ *        smallest distance between the first and last lines of the
+ *        grid, NULL to look at the whole picture.
+ * @param maxSpan for each direction the largest distance between the
+ *        first and last lines of the grid, NULL if minSpan is NULL.
+ * @param angles number of angles looked at by the Hough engine.
+ * @param maxAngle largest angle in degrees looked at by the Hough engine.
+ * @param xmin where the left bound is written.
+ * @param ymin where the upper bound is written.
+ * @param xmax where the right bound is written.
+ * @param ymax where the lower bound is written.
+ * @param confidence where a score of the grid found is written, to be
+ *        compared with the scores of other searches of the same engine.
+ * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ * @see gridLocate
+ */
+static int gridLocateSpans(Img * img,
+                           const int * minSpan,
+                           const int * maxSpan,
+                           int angles,
+                           double maxAngle,
+                           int * xmin,
+                           int * ymin,
+                           int * xmax,
+                           int * ymax,
+                           long int * confidence)
+{
+    if (gridEngine==GRID_ENGINE_HOUGH)
+        return gridLocateHough(img,angles,maxAngle,minSpan,maxSpan,
+                               xmin,ymin,xmax,ymax,confidence);
+    return gridLocateFilters(img,minSpan,maxSpan,
+                             xmin,ymin,xmax,ymax,confidence);
+}
+
+/**
+ * @brief Locates a sudoku grid in a picture.
+ *
+ * The work is done by the engine given by gridEngine.
+ *
+ * This function should not be called on a picture which is too large.
+ * Width and height of the picture between 200 and 400 pixels would be 
+ * a typical usage.
+ *
+ * @param img picture in which we are looking.
+ * @param xmin pointer to an integer where the horizontal position
+ *        of the lower left position of the grid will be written.
+ * @param ymin pointer to an integer where the vertical position
+ *        of the lower left position of the grid will be written.
+ * @param xmax pointer to an integer where the horizontal position
+ *        of the upper right position of the grid will be written.
+ * @param ymax pointer to an integer where the vertical position
+ *        of the upper right position of the grid will be written.
+ * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ */
+int gridLocate(Img * img,
+               int * xmin,
+               int * ymin,
+               int * xmax,
+               int * ymax)
+{
+    long int confidence;
+    return gridLocateSpans(img,NULL,NULL,
+                           GRID_HOUGH_ANGLES,GRID_HOUGH_MAX_ANGLE,
+                           xmin,ymin,xmax,ymax,&confidence);
+}
+
+/**
+ * @brief Moves a line of the grid to the brightest line of pixels in
+ *        a narrow band around it.
+ * @param img picture in which we are looking.
+ * @param dir 0 for a vertical line, 1 for a horizontal one.
+ * @param pos position of the line.
+ * @param from first pixel along the line taken into account.
+ * @param to last pixel along the line taken into account.
+ * @param band half width of the band in pixels.
+ * @return the new position of the line.
+ */
+static int gridRefineBound(Img*img,int dir,int pos,int from,int to,
+                           int band) {
+    int across=dir?img->height:img->width;
+    int along=dir?img->width:img->height;
+    if (from<0) from=0;
+    if (to>along-1) to=along-1;
+    int answer=pos<0?0:pos>across-1?across-1:pos;
+    long int best=-1;
+    for (int d=0;d<=2*band;++d) {
+        // look from the center of the band outwards
+        int p=pos+((d&1)?(d+1)/2:-d/2);
+        if (p<0 || p>=across) continue;
+        long int s=0;
+        for (int i=from;i<=to;++i) {
+            s+=dir?img->data[i+img->width*p]:img->data[p+img->width*i];
+        }
+        if (s>best) {
+            best=s;
+            answer=p;
+        }
+    }
+    return answer;
+}
+
+/**
+ * @brief Finds the first level of a pyramid small enough.
+ * @param pyramid pictures built by newImgFamPyramid.
+ * @param level finest level that can be used.
+ * @param size largest smallest side wanted.
+ * @return the first level from level whose smallest side is at most
+ *         size pixels, level if size is 0 or less.
+ */
+static int gridLevelOfSize(ImgFam * pyramid,int level,int size) {
+    int answer=level;
+    if (size<=0) return answer;
+    for (;answer+1<pyramid->count;++answer) {
+        Img * img = pyramid->imgs[answer];
+        int side=img->width<img->height?img->width:img->height;
+        if (side<=size) break;
+    }
+    return answer;
+}
+
+/**
+ * @brief Finds the level of a pyramid on which coarse searches run.
+ * @param pyramid pictures built by newImgFamPyramid.
+ * @param level finest level that can be used.
+ * @return the first level from level whose smallest side is at most
+ *         gridCoarseSize pixels, level if gridCoarseSize is 0 or less.
+ */
+static int gridCoarseLevel(ImgFam * pyramid,int level) {
+    return gridLevelOfSize(pyramid,level,gridCoarseSize);
+}
+
+/**
+ * @brief Looks again for the lines of a grid on a level of a pyramid,
+ *        from the grid found on the level above.
+ *
+ * The bounds are doubled, then the lines are looked for by
+ * gridLocateSpans in the part of the picture around them grown by a
+ * cell, for grids whose size differs by at most a cell. This finds a
+ * spacing wrong by one cell on a coarse level, where thin lines are
+ * blurred.
+ * @param img the level.
+ * @param xmin left bound on the level above, replaced.
+ * @param ymin upper bound on the level above, replaced.
+ * @param xmax right bound on the level above, replaced.
+ * @param ymax lower bound on the level above, replaced.
+ * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ */
+static int gridSearchAgain(Img * img,
+                           int * xmin,
+                           int * ymin,
+                           int * xmax,
+                           int * ymax)
+{
+    int lower[2]={2**xmin,2**ymin};
+    int upper[2]={2**xmax,2**ymax};
+    int size[2]={img->width,img->height};
+    int from[2],to[2],minSpan[2],maxSpan[2];
+    for (int dir=0;dir<2;++dir) {
+        int span=upper[dir]-lower[dir];
+        // a cell, plus the rounding of the level above
+        int cell=span/9+GRID_REFINE_BAND;
+        from[dir]=lower[dir]-cell-GRID_REFINE_BAND;
+        if (from[dir]<0) from[dir]=0;
+        to[dir]=upper[dir]+cell+GRID_REFINE_BAND+1;
+        if (to[dir]>size[dir]) to[dir]=size[dir];
+        minSpan[dir]=span-cell;
+        maxSpan[dir]=span+cell;
+    }
+    if (to[0]-from[0]<10 || to[1]-from[1]<10) return 1;
+    Img * region = imgExtract(img,from[0],from[1],to[0],to[1]);
+    long int confidence;
+    int answer=gridLocateSpans(region,minSpan,maxSpan,
+                               GRID_HOUGH_ANGLES,GRID_HOUGH_MAX_ANGLE,
+                               xmin,ymin,xmax,ymax,&confidence);
+    deleteImg(region);
+    *xmin+=from[0];*xmax+=from[0];
+    *ymin+=from[1];*ymax+=from[1];
+    return answer;
+}
+
+/**
+ * @brief Estimates the skew of the grid in a pyramid of inverted
+ *        pictures.
+ *
+ * imgEstimateSkew runs on the coarse level of gridLocatePyramid.
+ * Skews below GRID_MIN_SKEW degrees are ignored.
+ * @param pyramid pictures built by newImgFamPyramid.
+ * @return the angle in degrees to give to imgRotateBilinear to deskew
+ *         the pictures, 0 if they should be left as they are.
+ * @see imgEstimateSkew
+ */
+double gridEstimateSkew(ImgFam * pyramid) {
+    Img * img = pyramid->imgs[gridCoarseLevel(pyramid,0)];
+    double answer=imgEstimateSkew(img,0,GRID_MAX_SKEW);
+    TRACE(TRACE_INFO,"grid.skew","%.1f degrees",answer);
+    if (fabs(answer)<GRID_MIN_SKEW) return 0;
+    return answer;
+}
+
+/**
+ * @brief Brings bounds of a grid from a level of a pyramid to a finer
+ *        one.
+ *
+ * From one level to the next the bounds are doubled and each of them
+ * moved to the brightest line of pixels in a band of GRID_REFINE_BAND
+ * pixels around it. Down to the first level whose smallest side is at
+ * most gridFineSize pixels the spacing is also checked: the lines are
+ * looked for again by gridSearchAgain, and the ones found replace the
+ * doubled ones of a direction when they are more than half a cell
+ * away. The spacing is not checked when searchAgain is 0, so that the
+ * size of the grid only moves by GRID_REFINE_BAND pixels per level.
+ * @param pyramid pictures built by newImgFamPyramid.
+ * @param from level of the bounds given.
+ * @param to level of the bounds wanted, at most from.
+ * @param searchAgain non zero to check the spacing.
+ * @param xmin left bound, changed in place.
+ * @param ymin upper bound, changed in place.
+ * @param xmax right bound, changed in place.
+ * @param ymax lower bound, changed in place.
+ * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ */
+static int gridRefinePyramid(ImgFam * pyramid,
+                             int from,
+                             int to,
+                             int searchAgain,
+                             int * xmin,
+                             int * ymin,
+                             int * xmax,
+                             int * ymax)
+{
+    int fine=searchAgain?gridLevelOfSize(pyramid,to,gridFineSize):from;
+    for (int l=from-1;l>=to;--l) {
+        Img * img = pyramid->imgs[l];
+        int x0=2**xmin,x1=2**xmax,y0=2**ymin,y1=2**ymax;
+        int bandX=GRID_REFINE_BAND,bandY=GRID_REFINE_BAND;
+        if (l>=fine) {
+            int found[4]={*xmin,*ymin,*xmax,*ymax};
+            int answer=gridSearchAgain(img,&found[0],&found[1],
+                                       &found[2],&found[3]);
+            if (answer) return answer;
+            // when a line moved by more than half a cell the spacing
+            // was wrong on the level above, the lines found again are
+            // kept. Lines are equally spaced in the comb but not in a
+            // photo, so the bounds are then moved to the border lines
+            // within a third of a cell.
+            int cellX=(x1-x0)/9,cellY=(y1-y0)/9;
+            if (abs(found[0]-x0)>cellX/2 || abs(found[2]-x1)>cellX/2) {
+                x0=found[0];x1=found[2];
+                bandX=cellX/3;
+            }
+            if (abs(found[1]-y0)>cellY/2 || abs(found[3]-y1)>cellY/2) {
+                y0=found[1];y1=found[3];
+                bandY=cellY/3;
+            }
+        }
+        x0=gridRefineBound(img,0,x0,y0,y1,bandX);
+        x1=gridRefineBound(img,0,x1,y0,y1,bandX);
+        y0=gridRefineBound(img,1,y0,x0,x1,bandY);
+        y1=gridRefineBound(img,1,y1,x0,x1,bandY);
+        *xmin=x0;*xmax=x1;*ymin=y0;*ymax=y1;
+        TRACE(TRACE_INFO,"grid.pyramid","level %d: %d %d %d %d",
+              l,*xmin,*ymin,*xmax,*ymax);
+    }
+    return 0;
+}
+
+/**
+ * @brief Locates a sudoku grid from coarse to fine in a pyramid of
+ *        pictures.
+ *
+ * The grid is looked for by gridLocate on the first level whose
+ * smallest side is at most gridCoarseSize pixels. Then the bounds are
+ * brought to the level asked by gridRefinePyramid, which looks for
+ * the lines again on the levels of at most gridFineSize pixels.
+ * @param pyramid pictures built by newImgFamPyramid.
+ * @param level level on which the bounds are wanted.
+ * @param xmin pointer to an integer where the horizontal position
+ *        of the lower left position of the grid will be written.
+ * @param ymin pointer to an integer where the vertical position
+ *        of the lower left position of the grid will be written.
+ * @param xmax pointer to an integer where the horizontal position
+ *        of the upper right position of the grid will be written.
+ * @param ymax pointer to an integer where the vertical position
+ *        of the upper right position of the grid will be written.
+ * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ * @see newImgFamPyramid
+ * @see gridLocate
+ */
+int gridLocatePyramid(ImgFam * pyramid,
+                      int level,
+                      int * xmin,
+                      int * ymin,
+                      int * xmax,
+                      int * ymax)
+{
+    if (level<0 || level>=pyramid->count)
+        ERROR("No such level in the pyramid.","");
+    int coarse=gridCoarseLevel(pyramid,level);
+    int answer=gridLocate(pyramid->imgs[coarse],xmin,ymin,xmax,ymax);
+    if (answer) return answer;
+    TRACE(TRACE_INFO,"grid.pyramid","level %d: %d %d %d %d",
+          coarse,*xmin,*ymin,*xmax,*ymax);
+    return gridRefinePyramid(pyramid,coarse,level,1,xmin,ymin,xmax,ymax);
+}
+
+/**
+ * @brief Creates the state used to follow a grid along frames.
+ * @return a newly allocated state, without grid.
+ */
+GridTrack * newGridTrack() {
+    GridTrack * answer = (GridTrack*)malloc(sizeof(GridTrack));
+    memset(answer,0,sizeof(GridTrack));
+    return answer;
+}
+
+/**
+ * @brief Frees the state created by newGridTrack.
+ */
+void deleteGridTrack(GridTrack * track) {
+    free(track);
+}
+
+/**
+ * @brief Searches the region around the grid of the previous frame on
+ *        the coarse level of a pyramid.
+ * @param track grid of the previous frame.
+ * @param pyramid pictures of the current frame.
+ * @param coarse level searched.
+ * @param xmin where the left bound is written, at level coarse.
+ * @param ymin where the upper bound is written, at level coarse.
+ * @param xmax where the right bound is written, at level coarse.
+ * @param ymax where the lower bound is written, at level coarse.
+ * @param confidence where the confidence of gridLocateSpans is written.
+ * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ */
+static int gridTrackRegion(GridTrack * track,
+                           ImgFam * pyramid,
+                           int coarse,
+                           int * xmin,
+                           int * ymin,
+                           int * xmax,
+                           int * ymax,
+                           long int * confidence)
+{
+    Img * img = pyramid->imgs[coarse];
+    int lower[2]={track->xmin>>coarse,track->ymin>>coarse};
+    int upper[2]={track->xmax>>coarse,track->ymax>>coarse};
+    int size[2]={img->width,img->height};
+    // sizes are taken from the last full search so that they do not
+    // drift from one frame to the next
+    int reference[2]={track->width>>coarse,track->height>>coarse};
+    int from[2],to[2],minSpan[2],maxSpan[2];
+    for (int dir=0;dir<2;++dir) {
+        int span=upper[dir]-lower[dir];
+        from[dir]=lower[dir]-span/GRID_TRACK_MARGIN;
+        if (from[dir]<0) from[dir]=0;
+        to[dir]=upper[dir]+span/GRID_TRACK_MARGIN+1;
+        if (to[dir]>size[dir]) to[dir]=size[dir];
+        minSpan[dir]=reference[dir]*(100-GRID_TRACK_SPAN)/100;
+        maxSpan[dir]=reference[dir]*(100+GRID_TRACK_SPAN)/100+1;
+    }
+    *confidence=0;
+    if (to[0]-from[0]<10 || to[1]-from[1]<10) return 1;
+    Img * region = imgExtract(img,from[0],from[1],to[0],to[1]);
+    int answer=gridLocateSpans(region,minSpan,maxSpan,
+                               GRID_TRACK_HOUGH_ANGLES,
+                               GRID_TRACK_HOUGH_MAX_ANGLE,
+                               xmin,ymin,xmax,ymax,confidence);
+    deleteImg(region);
+    *xmin+=from[0];*xmax+=from[0];
+    *ymin+=from[1];*ymax+=from[1];
+    return answer;
+}
+
+/**
+ * @brief Builds the pyramid of a deskewed frame.
+ * @param inverseImage the frame, with its contrast scaled and inverted,
+ *        left as it is.
+ * @param center skew around which the skew of the frame is looked for.
+ * @param maxSkew largest distance to center of the skews tried.
+ * @param skew where the angle the frame is rotated by is written.
+ * @return a pyramid to be freed by deleteImgFam.
+ */
+static ImgFam * gridTrackDeskew(Img * inverseImage,
+                                double center,
+                                double maxSkew,
+                                double * skew)
+{
+    ImgFam * pyramid = newImgFamPyramid(inverseImage,1);
+    int coarse=gridCoarseLevel(pyramid,0);
+    *skew=imgEstimateSkew(pyramid->imgs[coarse],center,maxSkew);
+    if (fabs(*skew)<GRID_MIN_SKEW) *skew=0;
+    if (*skew!=0) {
+        Img * deskewed = imgRotateBilinear(inverseImage,*skew,0);
+        deleteImgFam(pyramid);
+        pyramid = newImgFamPyramid(deskewed,1);
+        deleteImg(deskewed);
+    }
+    return pyramid;
+}
+
+/**
+ * @brief Tells if the size of a tracked grid is within GRID_TRACK_SPAN
+ *        percent of the one of the last full search.
+ * @param span size found, in pixels.
+ * @param reference size found by the last full search.
+ * @return non zero if the size can be kept.
+ */
+static int gridTrackSpanOk(int span,int reference) {
+    return span*100>=reference*(100-GRID_TRACK_SPAN) &&
+        span*100<=reference*(100+GRID_TRACK_SPAN);
+}
+
+/**
+ * @brief Locates a sudoku grid in a frame of a sequence showing the
+ *        same grid.
+ *
+ * The frame is processed as cnn does: contrast, inversion, pyramid and
+ * deskew. When the previous frame had a grid, only the skews close to
+ * its one are tried and only the region around its grid is searched,
+ * for a grid of about the size found by the last full search. If the
+ * confidence of that search
+ * falls below GRID_TRACK_MIN_CONFIDENCE percent of the reference one,
+ * if the grid refined on the finest level is not within
+ * GRID_TRACK_SPAN percent of that size,
+ * or if there is no previous grid, the whole picture is deskewed and
+ * searched again by
+ * gridLocatePyramid and the reference confidence is set again. The
+ * frames are only tracked if the region search finds on that frame the
+ * same grid as the full search, so that a frame given again gets the
+ * same bounds.
+ * @param track state kept from one frame to the next, created by
+ *        newGridTrack.
+ * @param picture the frame, left as it is.
+ * @param xmin where the left bound is written, on the deskewed frame.
+ * @param ymin where the upper bound is written, on the deskewed frame.
+ * @param xmax where the right bound is written, on the deskewed frame.
+ * @param ymax where the lower bound is written, on the deskewed frame.
+ * @return 0 if a grid had been found, a number between 1 and 255 otherwise.
+ */
+int gridTrackFrame(GridTrack * track,
+                   Img * picture,
+                   int * xmin,
+                   int * ymin,
+                   int * xmax,
+                   int * ymax)
+{
+    Img * goodContastImage=imgLuminosityScale(picture);
+    Img * inverseImage = imgInvert(goodContastImage);
+    deleteImg(goodContastImage);
+    int tracked=track->found && track->reproducible;
+    double skew;
+    ImgFam * pyramid = tracked?
+        gridTrackDeskew(inverseImage,track->skew,GRID_TRACK_MAX_SKEW,&skew):
+        gridTrackDeskew(inverseImage,0,GRID_MAX_SKEW,&skew);
+    int coarse=gridCoarseLevel(pyramid,0);
+    track->frames++;
+    track->fullSearch=1;
+    int answer=1;
+    if (tracked) {
+        long int confidence;
+        answer=gridTrackRegion(track,pyramid,coarse,
+                               xmin,ymin,xmax,ymax,&confidence);
+        TRACE(TRACE_INFO,"grid.track","confidence %ld reference %ld",
+              confidence,track->reference);
+        // the spacing is not searched again while refining, so that
+        // the size of the grid stays the one of the last full search
+        if (!answer &&
+            confidence*100>=track->reference*GRID_TRACK_MIN_CONFIDENCE &&
+            !gridRefinePyramid(pyramid,coarse,0,0,xmin,ymin,xmax,ymax) &&
+            gridTrackSpanOk(*xmax-*xmin,track->width) &&
+            gridTrackSpanOk(*ymax-*ymin,track->height)) {
+            track->fullSearch=0;
+        }
+    }
+    if (track->fullSearch) {
+        track->fullSearches++;
+        if (tracked) {
+            // the skew of the previous frame is not the one of this frame
+            deleteImgFam(pyramid);
+            pyramid=gridTrackDeskew(inverseImage,0,GRID_MAX_SKEW,&skew);
+        }
+        answer=gridLocatePyramid(pyramid,0,xmin,ymin,xmax,ymax);
+    }
+    deleteImg(inverseImage);
+    track->found=!answer;
+    if (!answer) {
+        track->xmin=*xmin;track->ymin=*ymin;
+        track->xmax=*xmax;track->ymax=*ymax;
+        track->skew=skew;
+        if (track->fullSearch) {
+            track->width=*xmax-*xmin;
+            track->height=*ymax-*ymin;
+            // confidence of a region search on a frame known to be good,
+            // which must find the same grid for the next frames to be
+            // tracked
+            int x0,y0,x1,y1;
+            track->reproducible=
+                !gridTrackRegion(track,pyramid,coarse,&x0,&y0,&x1,&y1,
+                                 &track->reference) &&
+                !gridRefinePyramid(pyramid,coarse,0,0,&x0,&y0,&x1,&y1) &&
+                x0==*xmin && y0==*ymin && x1==*xmax && y1==*ymax;
+        }
+    }
+    deleteImgFam(pyramid);
+    return answer;
+}
+
+/**
+ * @brief Compares two strings for qsort.
+ */
+static int gridCompareNames(const void*a,const void*b) {
+    return strcmp(*(char*const*)a,*(char*const*)b);
+}
+
+/**
+ * @brief Adds the frames named by an argument: the pictures of a
+ *        directory sorted by name, or the argument itself.
+ * @param name a file or a directory.
+ * @param frames array of names, reallocated as needed.
+ * @param count number of names in frames, updated.
+ * @param capacity size of frames, updated.
+ */
+static void gridAddFrames(char * name,
+                          char *** frames,
+                          int * count,
+                          int * capacity)
+{
+    DIR * dir = opendir(name);
+    int first=*count;
+    if (dir==NULL) {
+        if (*count==*capacity) {
+            *capacity=2**capacity+16;
+            *frames=(char**)realloc(*frames,sizeof(char*)**capacity);
+        }
+        (*frames)[(*count)++]=stringCopy(name);
+        return;
+    }
+    struct dirent * e;
+    while ((e=readdir(dir))!=NULL) {
+        char * ext=strrchr(e->d_name,'.');
+        if (ext==NULL ||
+            (strcmp(ext,".png")!=0 && strcmp(ext,".jpg")!=0 &&
+             strcmp(ext,".jpeg")!=0)) continue;
+        if (*count==*capacity) {
+            *capacity=2**capacity+16;
+            *frames=(char**)realloc(*frames,sizeof(char*)**capacity);
+        }
+        char * path=(char*)malloc(strlen(name)+strlen(e->d_name)+2);
+        sprintf(path,"%s/%s",name,e->d_name);
+        (*frames)[(*count)++]=path;
+    }
+    closedir(dir);
+    qsort(*frames+first,*count-first,sizeof(char*),gridCompareNames);
+}
+
+/**
+ * @brief Follows a grid along frames and tells how long each one took,
+ *        the --track option of grid.
+ * @param argc number of arguments on the command line.
+ * @param argv value of arguments on the command line, the frames are
+ *        those not being options.
+ * @return 0, or 1 if a frame given twice in a row got other bounds.
+ */
+static int gridTrackMain(int argc,char**argv) {
+    char ** frames=NULL;
+    int count=0,capacity=0;
+    for (int j=1;j<argc;++j) {
+        if (strcmp(argv[j],"--threads")==0 ||
+            strcmp(argv[j],"--engine")==0 ||
+            strcmp(argv[j],"--trace")==0) {
+            ++j;
+        } else if (argv[j][0]!='-') {
+            gridAddFrames(argv[j],&frames,&count,&capacity);
+        }
+    }
+    if (count==0) ERROR("No frame to track.","");
+    GridTrack * track = newGridTrack();
+    double total=0;
+    int unstable=0;
+    int last[5]={1,0,0,0,0};
+    for (int i=0;i<count;++i) {
+        double start=gridNow();
+        int scale;
+        int previewSize=imgReadFormat(frames[i])==IMG_FORMAT_JPEG?
+            GRID_TRACK_DECODE_SIZE:0;
+        Img * picture = newImgReadScaled(frames[i],previewSize,&scale);
+        double read=gridNow();
+        int xmin,ymin,xmax,ymax;
+        int notFound=gridTrackFrame(track,picture,&xmin,&ymin,&xmax,&ymax);
+        double end=gridNow();
+        total+=end-start;
+        // bounds on the frame as it is in the file
+        xmin*=scale;ymin*=scale;xmax*=scale;ymax*=scale;
+        if (notFound) {
+            printf("%s: no grid, read %.1f ms, locate %.1f ms\n",
+                   frames[i],read-start,end-read);
+        } else {
+            printf("%s: %d %d %d %d %s, read %.1f ms, locate %.1f ms\n",
+                   frames[i],xmin,ymin,xmax,ymax,
+                   track->fullSearch?"full":"tracked",
+                   read-start,end-read);
+        }
+        // the same frame must get the same bounds
+        if (i>0 && strcmp(frames[i],frames[i-1])==0 &&
+            (notFound!=last[0] ||
+             (!notFound && (xmin!=last[1] || ymin!=last[2] ||
+                            xmax!=last[3] || ymax!=last[4])))) {
+            fprintf(stderr,"%s: not the bounds of the previous frame\n",
+                    frames[i]);
+            unstable=1;
+        }
+        last[0]=notFound;
+        last[1]=xmin;last[2]=ymin;last[3]=xmax;last[4]=ymax;
+        deleteImg(picture);
+        if (i>0) free(frames[i-1]);
+    }
+    free(frames[count-1]);
+    printf("%d frames, %d full searches, %.1f ms per frame\n",
+           track->frames,track->fullSearches,total/count);
+    deleteGridTrack(track);
+    free(frames);
+    return unstable;
+}
+
+/**
+ * @brief Reads the name of a grid engine.
+ * @param name "filters" or "hough".
+ * @return one of enum gridEngine.
+ */
+int gridParseEngine(char * name) {
+    if (strcmp(name,"filters")==0) return GRID_ENGINE_FILTERS;
+    if (strcmp(name,"hough")==0) return GRID_ENGINE_HOUGH;
+    ERROR("unknown grid engine: ",name);
+}
+
 /** 
  * @brief Tells how to use this program.
  * @param f where to write the info.
@@ -428,8 +1609,25 @@ void gridUsage(FILE*f,char*name) {
     fprintf(f,"    [-l|--layer] <n> :\n");
     fprintf(f,"         Output layer <n> to the disk for different values\n");
     fprintf(f,"         of fiters\n");
+    fprintf(f,"    --exact :\n");
+    fprintf(f,"         Never use the separable form of filters.\n");
     fprintf(f,"    [-g|--grid] :\n");
     fprintf(f,"         Try to find a sudoku grid.\n");
+    fprintf(f,"    [-t|--track] :\n");
+    fprintf(f,"         Follow a grid along frames: every argument not\n");
+    fprintf(f,"         being an option is a frame or a directory of\n");
+    fprintf(f,"         frames. Prints the grid and the time of each one.\n");
+    fprintf(f,"         Exits with 1 if a frame given twice in a row does\n");
+    fprintf(f,"         not get the same grid twice.\n");
+    fprintf(f,"    --threads <n> :\n");
+    fprintf(f,"         Number of threads to use, by default the value of\n");
+    fprintf(f,"         CNN_THREADS or the number of processors.\n");
+    fprintf(f,"    --engine <filters|hough> :\n");
+    fprintf(f,"         How the lines of the grid are found: convolutions\n");
+    fprintf(f,"         with rotated bars (default) or Hough transform.\n");
+    fprintf(f,"    --trace <off|info|data|all> :\n");
+    fprintf(f,"         Level of the traces written, by default the value\n");
+    fprintf(f,"         of CNN_TRACE or off.\n");
     fprintf(f,"    [-h|--help] :\n");
     fprintf(f,"         Displays this help message and leaves.\n");
 }
@@ -442,12 +1640,29 @@ void gridUsage(FILE*f,char*name) {
  */
 int gridMain(int argc,char**argv) {
     int showLevel1=0;
+    int track=0;
     for (int j=1;j<argc;++j) {
         if (strcmp(argv[j],"-h")==0 || strcmp(argv[j],"--help")==0) {
             gridUsage(stdout,argv[0]);
             exit(0);
         }
+        if (strcmp(argv[j],"--exact")==0) {
+            filterForceExact=1;
+        }
+        if (strcmp(argv[j],"--threads")==0 && j+1<argc) {
+            poolThreads=atoi(argv[++j]);
+        }
+        if (strcmp(argv[j],"--engine")==0 && j+1<argc) {
+            gridEngine=gridParseEngine(argv[++j]);
+        }
+        if (strcmp(argv[j],"--trace")==0 && j+1<argc) {
+            traceLevel=traceParseLevel(argv[++j]);
+        }
+        if (strcmp(argv[j],"-t")==0 || strcmp(argv[j],"--track")==0) {
+            track=1;
+        }
     }
+    if (track) return gridTrackMain(argc,argv);
     if(argc < 3) {
         gridUsage(stderr,argv[0]);
         ERROR("At least 2 argumens expected, the picture to read, and where tp write the output","");
@@ -466,11 +1681,21 @@ int gridMain(int argc,char**argv) {
     }
     int i=2;
     while (i<argc) {
-        if (strcmp("-g",argv[i])==0 ||
+        if (strcmp("--exact",argv[i])==0) {
+            // already taken into account
+        } else if (strcmp("--threads",argv[i])==0 ||
+                   strcmp("--engine",argv[i])==0 ||
+                   strcmp("--trace",argv[i])==0) {
+            // already taken into account
+            ++i;
+        } else if (strcmp("-g",argv[i])==0 ||
             strcmp("--grid",argv[i])==0) {
             int xmin,ymin,xmax,ymax;
             // locate the grid
-            if (!gridLocate(currentImage,&xmin,&ymin,&xmax,&ymax)) {
+            ImgFam * pyramid = newImgFamPyramid(currentImage,1);
+            int notFound=gridLocatePyramid(pyramid,0,&xmin,&ymin,&xmax,&ymax);
+            deleteImgFam(pyramid);
+            if (!notFound) {
                 HERE("Found sudoku grid :");
                 printf("%d %d %d %d\n",xmin,ymin,xmax,ymax);
                 // draw the grid found
@@ -489,7 +1714,6 @@ int gridMain(int argc,char**argv) {
             case 0:
                 {
                     int scaleFactor=0;
-                    gridDumpDebugInfo=1;
                     gridPreprocessRawPicture(argv[1],&scaleFactor,1);
                 }
                 break;
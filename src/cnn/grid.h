@@ -8,10 +8,75 @@
  */
 
 typedef struct img Img;
+typedef struct imgfam ImgFam;
+
+/**
+ * @brief Ways gridLocate can find the lines of a grid.
+ */
+enum gridEngine {
+    /** convolutions with rotated bars, then spacing of the lines */
+    GRID_ENGINE_FILTERS=0,
+    /** Hough transform of the gradient, then spacing of the lines */
+    GRID_ENGINE_HOUGH=1
+};
+
+/**
+ * @brief What gridTrackFrame keeps from one frame to the next.
+ */
+struct gridTrack {
+    /** non zero when a grid was found in the previous frame */
+    int found;
+    /** left bound of the grid of the previous frame */
+    int xmin;
+    /** upper bound of the grid of the previous frame */
+    int ymin;
+    /** right bound of the grid of the previous frame */
+    int xmax;
+    /** lower bound of the grid of the previous frame */
+    int ymax;
+    /** angle the previous frame was rotated by to deskew it */
+    double skew;
+    /** width of the grid of the last fully searched frame */
+    int width;
+    /** height of the grid of the last fully searched frame */
+    int height;
+    /** confidence of a region search on the last fully searched frame */
+    long int reference;
+    /** non zero if that region search found the same grid again */
+    int reproducible;
+    /** non zero if the whole last frame was searched */
+    int fullSearch;
+    /** number of frames given to gridTrackFrame */
+    int frames;
+    /** number of frames whose whole picture was searched */
+    int fullSearches;
+};
+
+/**
+ * @brief Short name for 'struct gridTrack'
+ */
+typedef struct gridTrack GridTrack;
+
+extern int gridEngine;
+extern int gridCoarseSize;
+extern int gridFineSize;
+extern int gridFilterMaxDegrees;
 
 int gridLocate(Img * img,
                int * xmin, int * ymin,
                int * xmax, int * ymax);
+int gridLocatePyramid(ImgFam * pyramid,
+                      int level,
+                      int * xmin, int * ymin,
+                      int * xmax, int * ymax);
+double gridEstimateSkew(ImgFam * pyramid);
+GridTrack * newGridTrack();
+void deleteGridTrack(GridTrack * track);
+int gridTrackFrame(GridTrack * track,
+                   Img * picture,
+                   int * xmin, int * ymin,
+                   int * xmax, int * ymax);
+int gridParseEngine(char * name);
 int gridMain(int argc,char**argv);
 
 #endif
@@ -0,0 +1,399 @@
+#include <math.h>
+#include "hough.h"
+#include "conv.h"
+#include "pool.h"
+
+/**
+ * @file hough.c
+ * @brief Implements the Hough transform defined in hough.h.
+ *
+ * The gradient of the picture is computed once with the Sobel
+ * operator, eight or sixteen pixels at a time with SSE2 or AVX2 when
+ * the convolution engine runs on them. Each pixel with a large enough
+ * gradient then casts a single vote: the direction of its gradient
+ * gives the angle of the line it belongs to, so that the cost is
+ * linear in the number of pixels whatever the number of angles.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HOUGH_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Pixels with a Sobel gradient, sum of the absolute values of
+ *        both components, below this value do not vote.
+ */
+int houghMinGradient=64;
+
+/**
+ * @brief Computes the Sobel gradient of pixels of a row one by one.
+ * @param p first pixel of the row, the rows above and below are read.
+ * @param stride number of bytes between two rows.
+ * @param n number of pixels.
+ * @param gx where the horizontal gradients are written.
+ * @param gy where the vertical gradients are written.
+ */
+static void houghSobelRowScalar(const unsigned char * p,
+                                int stride,
+                                int n,
+                                short * gx,
+                                short * gy)
+{
+    const unsigned char * a=p-stride;
+    const unsigned char * b=p+stride;
+    for (int x=0;x<n;++x) {
+        gx[x]=(a[x+1]+2*p[x+1]+b[x+1])-(a[x-1]+2*p[x-1]+b[x-1]);
+        gy[x]=(b[x-1]+2*b[x]+b[x+1])-(a[x-1]+2*a[x]+a[x+1]);
+    }
+}
+
+#ifdef HOUGH_HAVE_X86
+/**
+ * @brief SSE2 version of houghSobelRowScalar, 8 pixels at a time.
+ */
+__attribute__((target("sse2")))
+static void houghSobelRowSse2(const unsigned char * p,
+                              int stride,
+                              int n,
+                              short * gx,
+                              short * gy)
+{
+    const unsigned char * a=p-stride;
+    const unsigned char * b=p+stride;
+    __m128i zero=_mm_setzero_si128();
+#define HOUGH_LOAD8(q) \
+    _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(q)),zero)
+    int x=0;
+    for (;x+8<=n;x+=8) {
+        __m128i al=HOUGH_LOAD8(a+x-1),am=HOUGH_LOAD8(a+x);
+        __m128i ar=HOUGH_LOAD8(a+x+1);
+        __m128i pl=HOUGH_LOAD8(p+x-1),pr=HOUGH_LOAD8(p+x+1);
+        __m128i bl=HOUGH_LOAD8(b+x-1),bm=HOUGH_LOAD8(b+x);
+        __m128i br=HOUGH_LOAD8(b+x+1);
+        __m128i r=_mm_add_epi16(_mm_add_epi16(ar,br),_mm_add_epi16(pr,pr));
+        __m128i l=_mm_add_epi16(_mm_add_epi16(al,bl),_mm_add_epi16(pl,pl));
+        __m128i d=_mm_add_epi16(_mm_add_epi16(bl,br),_mm_add_epi16(bm,bm));
+        __m128i u=_mm_add_epi16(_mm_add_epi16(al,ar),_mm_add_epi16(am,am));
+        _mm_storeu_si128((__m128i*)(gx+x),_mm_sub_epi16(r,l));
+        _mm_storeu_si128((__m128i*)(gy+x),_mm_sub_epi16(d,u));
+    }
+#undef HOUGH_LOAD8
+    houghSobelRowScalar(p+x,stride,n-x,gx+x,gy+x);
+}
+
+/**
+ * @brief AVX2 version of houghSobelRowScalar, 16 pixels at a time.
+ */
+__attribute__((target("avx2")))
+static void houghSobelRowAvx2(const unsigned char * p,
+                              int stride,
+                              int n,
+                              short * gx,
+                              short * gy)
+{
+    const unsigned char * a=p-stride;
+    const unsigned char * b=p+stride;
+#define HOUGH_LOAD16(q) \
+    _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(q)))
+    int x=0;
+    for (;x+16<=n;x+=16) {
+        __m256i al=HOUGH_LOAD16(a+x-1),am=HOUGH_LOAD16(a+x);
+        __m256i ar=HOUGH_LOAD16(a+x+1);
+        __m256i pl=HOUGH_LOAD16(p+x-1),pr=HOUGH_LOAD16(p+x+1);
+        __m256i bl=HOUGH_LOAD16(b+x-1),bm=HOUGH_LOAD16(b+x);
+        __m256i br=HOUGH_LOAD16(b+x+1);
+        __m256i r=_mm256_add_epi16(_mm256_add_epi16(ar,br),
+                                   _mm256_add_epi16(pr,pr));
+        __m256i l=_mm256_add_epi16(_mm256_add_epi16(al,bl),
+                                   _mm256_add_epi16(pl,pl));
+        __m256i d=_mm256_add_epi16(_mm256_add_epi16(bl,br),
+                                   _mm256_add_epi16(bm,bm));
+        __m256i u=_mm256_add_epi16(_mm256_add_epi16(al,ar),
+                                   _mm256_add_epi16(am,am));
+        _mm256_storeu_si256((__m256i*)(gx+x),_mm256_sub_epi16(r,l));
+        _mm256_storeu_si256((__m256i*)(gy+x),_mm256_sub_epi16(d,u));
+    }
+#undef HOUGH_LOAD16
+    houghSobelRowSse2(p+x,stride,n-x,gx+x,gy+x);
+}
+#endif
+
+/**
+ * @brief Function computing the Sobel gradient of a row.
+ */
+typedef void (*HoughSobelRow)(const unsigned char * p,
+                              int stride,
+                              int n,
+                              short * gx,
+                              short * gy);
+
+/**
+ * @brief What the tasks of houghSobel share.
+ */
+struct houghSobelTask {
+    /** input picture */
+    Img * in;
+    /** horizontal gradients */
+    short * gx;
+    /** vertical gradients */
+    short * gy;
+    /** row kernel to use */
+    HoughSobelRow row;
+    /** number of rows of a task */
+    int rows;
+};
+
+/**
+ * @brief Computes the gradient of a band of rows of houghSobel.
+ * @param arg a struct houghSobelTask.
+ * @param k index of the band.
+ */
+static void houghSobelTaskRun(void*arg,int k) {
+    struct houghSobelTask * t = (struct houghSobelTask*)arg;
+    int w=t->in->width;
+    int h=t->in->height;
+    int y0=1+k*t->rows;
+    int y1=y0+t->rows;
+    if (y1>h-1) y1=h-1;
+    for (int y=y0;y<y1;++y) {
+        t->row(&t->in->data[1+w*y],w,w-2,&t->gx[1+w*y],&t->gy[1+w*y]);
+    }
+}
+
+/**
+ * @brief Computes the Sobel gradient of a picture.
+ *
+ * Pixels on the border of the picture get a null gradient.
+ * @param in the input picture.
+ * @param gx where the in->width*in->height horizontal gradients,
+ *        between -1020 and 1020, are written.
+ * @param gy where the vertical gradients are written.
+ */
+void houghSobel(Img*in,short*gx,short*gy) {
+    int w=in->width;
+    int h=in->height;
+    memset(gx,0,sizeof(short)*w*h);
+    memset(gy,0,sizeof(short)*w*h);
+    if (w<3 || h<3) return;
+    HoughSobelRow row=houghSobelRowScalar;
+#ifdef HOUGH_HAVE_X86
+    switch (convGetIsa()) {
+    case CONV_ISA_AVX2: row=houghSobelRowAvx2; break;
+    case CONV_ISA_SSE2: row=houghSobelRowSse2; break;
+    }
+#endif
+    int bands=poolGetThreads()*4;
+    struct houghSobelTask t={in,gx,gy,row,(h-2+bands-1)/bands};
+    poolFor((h-2+t.rows-1)/t.rows,houghSobelTaskRun,&t);
+}
+
+/**
+ * @brief What the tasks of newHough share.
+ */
+struct houghVoteTask {
+    /** accumulator being filled */
+    Hough * h;
+    /** horizontal gradients */
+    const short * gx;
+    /** vertical gradients */
+    const short * gy;
+};
+
+/**
+ * @brief Casts the votes for vertical (dir==0) or horizontal
+ *        (dir==1) lines.
+ *
+ * A line at angle a from the vertical has a gradient at angle a from
+ * the horizontal, so the tangent of a is -gy/gx. The pixel then votes
+ * for the line at that angle going through it.
+ * @param arg a struct houghVoteTask.
+ * @param dir direction of the lines.
+ */
+static void houghVoteTaskRun(void*arg,int dir) {
+    struct houghVoteTask * t = (struct houghVoteTask*)arg;
+    Hough * h = t->h;
+    int w=h->width;
+    int half=h->angles/2;
+    double tanMax=tan(h->maxAngle*M_PI/180);
+    double tanAngle[h->angles];
+    for (int a=0;a<h->angles;++a) {
+        tanAngle[a]=half?tanMax*(a-half)/half:0;
+    }
+    double binsPerTan=half?half/tanMax:0;
+    // along is the coordinate along the lines, across the one across
+    int alongSize=dir?w:h->height;
+    int acrossSize=dir?h->height:w;
+    int * acc=dir?h->hori:h->vert;
+    for (int y=0;y<h->height;++y) {
+        const short * gx=t->gx+w*y;
+        const short * gy=t->gy+w*y;
+        for (int x=0;x<w;++x) {
+            int across=dir?gy[x]:gx[x];
+            int along=dir?gx[x]:gy[x];
+            int aa=across<0?-across:across;
+            int ab=along<0?-along:along;
+            if (aa+ab<houghMinGradient || ab>aa) continue;
+            int a=half+(int)lround(-along*binsPerTan/across);
+            if (a<0 || a>=h->angles) continue;
+            int u=dir?x:y;
+            int v=dir?y:x;
+            int rho=v-(int)lround((u-alongSize/2)*tanAngle[a]);
+            if (rho<0 || rho>=acrossSize) continue;
+            acc[a*acrossSize+rho]+=aa+ab;
+        }
+    }
+}
+
+/**
+ * @brief Builds the votes of a picture for lines close to vertical
+ *        or horizontal.
+ * @param img the input picture.
+ * @param angles number of angles looked at in each direction, odd.
+ * @param maxAngle largest angle in degrees between a line and the
+ *        vertical or horizontal.
+ * @return the newly allocated votes, to be freed with deleteHough.
+ */
+Hough * newHough(Img*img,int angles,double maxAngle) {
+    if (angles<1 || angles%2==0)
+        ERROR("An odd number of angles is expected.","");
+    Hough * answer = (Hough*)malloc(sizeof(struct hough));
+    answer->width=img->width;
+    answer->height=img->height;
+    answer->angles=angles;
+    answer->maxAngle=maxAngle;
+    answer->vert=(int*)calloc((size_t)angles*img->width,sizeof(int));
+    answer->hori=(int*)calloc((size_t)angles*img->height,sizeof(int));
+    int n=img->width*img->height;
+    short * gx=(short*)malloc(sizeof(short)*(n>0?n:1));
+    short * gy=(short*)malloc(sizeof(short)*(n>0?n:1));
+    houghSobel(img,gx,gy);
+    struct houghVoteTask t={answer,gx,gy};
+    poolFor(2,houghVoteTaskRun,&t);
+    free(gx);
+    free(gy);
+    return answer;
+}
+
+/**
+ * @brief Frees the votes built by newHough.
+ * @param h the votes.
+ */
+void deleteHough(Hough*h) {
+    if (h==NULL) return;
+    free(h->vert);
+    free(h->hori);
+    free(h);
+}
+
+/**
+ * @brief Finds the angle at which lines of a direction are the
+ *        sharpest, the one where votes have the largest sum of squares.
+ * @param h the votes.
+ * @param dir 0 for vertical lines, 1 for horizontal ones.
+ * @return the index of the angle, h->angles/2 being 0 degree.
+ */
+int houghBestAngle(Hough*h,int dir) {
+    int n=dir?h->height:h->width;
+    const int * acc=dir?h->hori:h->vert;
+    int answer=h->angles/2;
+    double best=-1;
+    for (int a=0;a<h->angles;++a) {
+        double s=0;
+        for (int i=0;i<n;++i) {
+            s+=(double)acc[a*n+i]*acc[a*n+i];
+        }
+        if (s>best) {
+            best=s;
+            answer=a;
+        }
+    }
+    return answer;
+}
+
+/**
+ * @brief Finds N equally spaced lines of a direction and an angle.
+ *
+ * Every first line and spacing is scored by the sum of the votes of
+ * the N lines, each one taking the best of its position and the two
+ * next to it so that a line between two positions is not lost. The
+ * square root of the votes is used so that the thick lines around the
+ * 3x3 blocks do not outweigh the thin ones. The cost is the square of
+ * the size of the picture times N.
+ * @param h the votes.
+ * @param dir 0 for vertical lines, 1 for horizontal ones.
+ * @param angle index of the angle.
+ * @param N number of lines.
+ * @param minSpan smallest distance between the first and last lines.
+ * @param maxSpan largest distance between the first and last lines.
+ * @param first where the position of the first line is written.
+ * @param last where the position of the last line is written.
+ * @return the score of the lines found, 0 if none.
+ */
+long int houghFindLines(Hough*h,
+                        int dir,
+                        int angle,
+                        int N,
+                        int minSpan,
+                        int maxSpan,
+                        int * first,
+                        int * last)
+{
+    int n=dir?h->height:h->width;
+    const int * acc=(dir?h->hori:h->vert)+angle*n;
+    int near[n>0?n:1];
+    for (int i=0;i<n;++i) {
+        int v=acc[i];
+        if (i>0 && acc[i-1]>v) v=acc[i-1];
+        if (i+1<n && acc[i+1]>v) v=acc[i+1];
+        near[i]=(int)sqrt((double)v);
+    }
+    *first=0;
+    *last=n>0?n-1:0;
+    if (N<2) return 0;
+    if (minSpan<N-1) minSpan=N-1;
+    long int best=0;
+    for (int span=minSpan;span<n && span<=maxSpan;++span) {
+        int pos[N];
+        for (int k=0;k<N;++k) {
+            pos[k]=(k*span+(N-1)/2)/(N-1);
+        }
+        for (int j=0;j+span<n;++j) {
+            long int s=0;
+            for (int k=0;k<N;++k) {
+                s+=near[j+pos[k]];
+            }
+            if (s>best) {
+                best=s;
+                *first=j;
+                *last=j+span;
+            }
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Gets the votes for the lines of a direction and an angle as
+ *        a picture of one row.
+ *
+ * Votes are scaled so that the largest one is white.
+ * @param h the votes.
+ * @param dir 0 for vertical lines, 1 for horizontal ones.
+ * @param angle index of the angle.
+ * @return a newly allocated picture of h->width (or h->height) by 1
+ *         pixels.
+ */
+Img * houghProfile(Hough*h,int dir,int angle) {
+    int n=dir?h->height:h->width;
+    const int * acc=(dir?h->hori:h->vert)+angle*n;
+    long int maxVal=1;
+    for (int i=0;i<n;++i) {
+        if (acc[i]>maxVal) maxVal=acc[i];
+    }
+    Img * answer = newImgColor(n,1,0);
+    for (int i=0;i<n;++i) {
+        answer->data[i]=255L*acc[i]/maxVal;
+    }
+    return answer;
+}
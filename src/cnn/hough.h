@@ -0,0 +1,57 @@
+#ifndef HOUGH_H
+#define HOUGH_H
+
+/**
+ * @file hough.h
+ * @brief Header of the Hough transform used to find lines close to
+ *        vertical or horizontal in a picture.
+ */
+
+#include "img.h"
+
+/**
+ * @brief Votes of the pixels of a picture for lines close to vertical
+ *        or horizontal.
+ *
+ * A vertical line is given by its angle and by its abscissa on the
+ * middle row of the picture, a horizontal line by its angle and by its
+ * ordinate on the middle column.
+ */
+struct hough {
+    /** width of the picture */
+    int width;
+    /** height of the picture */
+    int height;
+    /** number of angles for each direction, odd so that 0 is one */
+    int angles;
+    /** largest angle in degrees between a line and the vertical or
+        horizontal */
+    double maxAngle;
+    /** votes for vertical lines: angles rows of width values */
+    int * vert;
+    /** votes for horizontal lines: angles rows of height values */
+    int * hori;
+};
+
+/**
+ * @brief Short name for 'struct hough'
+ */
+typedef struct hough Hough;
+
+extern int houghMinGradient;
+
+void houghSobel(Img*in,short*gx,short*gy);
+Hough * newHough(Img*img,int angles,double maxAngle);
+void deleteHough(Hough*);
+int houghBestAngle(Hough*h,int dir);
+long int houghFindLines(Hough*h,
+                        int dir,
+                        int angle,
+                        int N,
+                        int minSpan,
+                        int maxSpan,
+                        int * first,
+                        int * last);
+Img * houghProfile(Hough*h,int dir,int angle);
+
+#endif
@@ -15,6 +15,10 @@ struct img {
      * Its size should be width times height.
      */
     unsigned char * data;
+    /** NULL when data is owned by the picture, otherwise the tensor
+     * file data is mapped from, see tensorMapImg.
+     */
+    struct tensorMap * map;
 };
 
 /**
@@ -22,12 +26,53 @@ struct img {
  */
 typedef struct img Img;
 
+/**
+ * @brief Row filters of the png files written, see imgWritePng.
+ */
+enum imgPngFilter {
+    /** libpng picks the filter of each row, the smallest files */
+    IMG_PNG_FILTER_ADAPTIVE=0,
+    /** rows are not filtered */
+    IMG_PNG_FILTER_NONE=1,
+    /** difference with the pixel on the left */
+    IMG_PNG_FILTER_SUB=2,
+    /** difference with the pixel above, the fastest at level 1, see
+        imgWritePng */
+    IMG_PNG_FILTER_UP=3,
+    /** difference with a guess from the left, upper and upper left
+        pixels */
+    IMG_PNG_FILTER_PAETH=4
+};
+
+/**
+ * @brief Formats of the pictures read, told by their first bytes.
+ */
+enum imgFormat {
+    /** neither png nor jpeg */
+    IMG_FORMAT_UNKNOWN=0,
+    /** starts with the 8 bytes of the png signature */
+    IMG_FORMAT_PNG=1,
+    /** starts with a start of image marker then another marker */
+    IMG_FORMAT_JPEG=2,
+    /** starts with TENSOR_MAGIC */
+    IMG_FORMAT_TENSOR=3
+};
+
+extern int imgPngLevel;
+extern int imgPngFilter;
+
 /* external data types */
 typedef struct filter Filter;
+typedef struct tensorMap TensorMap;
 
 Img * newImgFromArray(int w, int h, unsigned char *s);
 Img * newImgColor(int w, int h, unsigned char c);
 Img * newImgRead(char *filename);
+Img * newImgReadScaled(char *filename,int minSize,int * scale);
+Img * newImgReadRegion(char *filename,int * xmin,int * ymin,
+                       int xmax,int ymax);
+Img * newImgReadMemory(const void * data,size_t size);
+int imgReadFormat(char * filename);
 Img * newImgCopy(Img*myImg);
 Img * newImg9By9Dots(int w);
 Img * newImgNDotsHori(int N,int w);
@@ -41,22 +86,31 @@ Img * imgDivideByTwo(Img* img);
 unsigned char imgGetVal(Img*p,int x, int y);
 void imgPrint(Img*myImg);
 void imgWrite(Img*myImg,char *filename);
+void imgWritePng(Img*myImg,char *filename,int level,int filter);
+int imgParsePngFilter(char * name);
 Img * imgInvert(Img*in);
 Img * imgFlattenContrast(Img*in);
 Img * imgRaiseContrast(Img*in);
 Img * imgBlur(Img*in,int radius);
 Img * imgMake3dEffect(Img*in);
 Img * imgLuminosityScale(Img*in);
+void imgLuminosityLut(Img*in,unsigned char*lut);
 Img * imgConvolution(Img*in,Filter*filter);
 Img * imgConvolutionDiff(Img*in,Filter*filter);
 Img * imgConvolutionSameSize(Img*in,Filter*filter);
 Img * imgConvolutionSameSizeDiff(Img*in,Filter*filter);
+Img * imgConvolutionMaxPool(Img*in,Filter*filter,int poolsize,int stride);
 Img * imgDownSampleAvg(Img* img,int poolsize,int stride);
 Img * imgDownSampleMax(Img* img,int poolsize,int stride);
 void imgDrawRect(Img*myImg,int xmin,int ymin,int xmax,int ymax);
+void imgDrawQuad(Img*myImg,const double*corners);
 unsigned char imgScalar(Img*,Img*,int,int);
 Img * imgRotate(Img* img,int deg);
 Img * imgRotate90(Img* img);
+Img * imgRotateBilinear(Img* img,double deg,unsigned char background);
+void imgRotateBilinearSource(int w,int h,double deg,double x,double y,
+                             double * xs,double * ys);
+double imgEstimateSkew(Img*img,double center,double maxAngle);
 Img * imgEdgeDetect(Img * img);
 Img * imgScale(Img*in,int s);
 Img * imgExtract(Img*myImg,int xmin,int ymin,int xmax,int ymax);
@@ -1,6 +1,7 @@
 #include <limits.h>
 #include "imgfam.h"
 #include "filterfam.h"
+#include "tensor.h"
 
 /**
  * @brief create a a new familly of images.
@@ -29,6 +30,61 @@ void deleteImgFam(ImgFam * ifa) {
     free(ifa);
 }
 
+/**
+ * @brief Computes one row of a level of a pyramid from the two rows
+ *        of the finer level above it, then the rows of the coarser
+ *        levels that row completes.
+ * @param pyramid the pyramid being built.
+ * @param level level whose row y has just been computed.
+ * @param y the row.
+ */
+static void imgFamPyramidRow(ImgFam*pyramid,int level,int y) {
+    if (level+1>=pyramid->count || (y&1)==0) return;
+    Img * src = pyramid->imgs[level];
+    Img * dst = pyramid->imgs[level+1];
+    if ((y>>1)>=dst->height) return;
+    const unsigned char * a = &src->data[src->width*(y-1)];
+    const unsigned char * b = &src->data[src->width*y];
+    unsigned char * d = &dst->data[dst->width*(y>>1)];
+    for (int x=0;x<dst->width;++x) {
+        // same average of 4 pixels as imgDivideByTwo
+        d[x]=(a[2*x]+a[2*x+1]+b[2*x]+b[2*x+1])>>2;
+    }
+    imgFamPyramidRow(pyramid,level+1,y>>1);
+}
+
+/**
+ * @brief Builds a pyramid of images, each level being the previous
+ *        one divided by two.
+ *
+ * Levels are the ones repeated calls to imgDivideByTwo would give but
+ * they are built in a single pass over the input: a row of a level is
+ * computed as soon as the two rows it comes from are, while they are
+ * still in the cache.
+ * @param img the input image, copied as level 0.
+ * @param minSize levels are added while the width and height of the
+ *        last one are both above this value.
+ * @return the newly allocated familly, level i being in imgs[i].
+ */
+ImgFam * newImgFamPyramid(Img*img,int minSize) {
+    if (minSize<1) minSize=1;
+    int count=1;
+    for (int w=img->width,h=img->height;w>minSize && h>minSize;
+         w/=2,h/=2) {
+        ++count;
+    }
+    ImgFam * answer = newImgFam(count);
+    imgFamSetImg(answer,0,newImgCopy(img));
+    for (int i=1;i<count;++i) {
+        Img * prev = answer->imgs[i-1];
+        imgFamSetImg(answer,i,newImgColor(prev->width/2,prev->height/2,0));
+    }
+    for (int y=0;y<img->height;++y) {
+        imgFamPyramidRow(answer,0,y);
+    }
+    return answer;
+}
+
 /**
  * @brief set the i-th image of a familly of images.
  * @param imgFam the familly of images in which we are going to set the image.
@@ -91,27 +147,44 @@ ImgFam * imgFamDownSampleAvg(ImgFam* imgFam,int poolsize,int stride) {
  * @param imgFam the familly to save.
  * @param basename the base name for all files save. The final
  *   name of each file will be basename_i.png where i
- *   is the number of the picture in the familly.
+ *   is the number of the picture in the familly. The whole familly
+ *   is also saved in basename.tensor.
  * @see imgFamRead
  */
 void imgFamWrite(ImgFam*imgFam,char*basename) {
     char s[99];
+    char names[imgFam->count>0?imgFam->count:1][99];
+    char * sources[imgFam->count>0?imgFam->count:1];
     for (int i=0;i<imgFam->count;++i) {
-        snprintf(s,99,"%s_%d.png",basename,i);
-        imgWrite(imgFam->imgs[i],s);
+        snprintf(names[i],99,"%s_%d.png",basename,i);
+        imgWrite(imgFam->imgs[i],names[i]);
+        sources[i]=names[i];
     }
+    snprintf(s,99,"%s.tensor",basename);
+    tensorWriteImgFam(imgFam,s,sources);
 }
 
 /**
  * @brief Read a set of png files to return an image familly.
  * @param basename the base name for all files read.
  *   names read have the form basename_i.png where i
- *   is the number of the picture in the familly.
+ *   is the number of the picture in the familly. basename.tensor
+ *   is mapped instead when it exists and none of the png files
+ *   changed since it was written.
  * @return a newly allocated image familly.
  * @see imgFamWrite
  */
 ImgFam * imgFamRead(char*basename) {
     char s[99];
+    snprintf(s,99,"%s.tensor",basename);
+    TensorMap * map = newTensorMapFound(s);
+    if (map!=NULL) {
+        ImgFam * answer =
+            tensorFamilyIsStale(map,0,map->count,basename)?NULL:
+            tensorMapImgFam(map);
+        deleteTensorMap(map);
+        if (answer!=NULL) return answer;
+    }
     int count=0;
     int found=1;
     while (found) {
@@ -23,6 +23,7 @@ typedef struct imgfam ImgFam;
 typedef struct filterfam FilterFam;
 
 ImgFam * newImgFam(int);
+ImgFam * newImgFamPyramid(Img*img,int minSize);
 void imgFamSetImg(ImgFam*,int,Img*);
 ImgFam * imgFamApplyConvolution(ImgFam*,Filter*);
 ImgFam * imgFamDownSampleMax(ImgFam*,int,int);
@@ -46,18 +46,26 @@ int layerCount(char * convFilterLoc) {
 
 /**
  * @brief Passes an image through a layer
+ *
+ * Convolution and max pooling are fused, so that full size results
+ * of the convolution are not stored.
  * @param l a layer 
  * @param i an image
  * @return output of i through l
  */
 ImgFam * layerPassImg(Layer*l,Img*i) {
-    ImgFam * intermediateOutput =
-        filterFamApplyConvolution(l->convFilter,i);
-    ImgFam * maxPoolOutput=imgFamDownSampleMax(intermediateOutput,
-                                               l->downSamplePoolSize,
-                                               l->downSampleStride);
-    deleteImgFam(intermediateOutput);
-    return maxPoolOutput;
+    if (l->downSamplePoolSize<1 || l->downSampleStride<1) {
+        ImgFam * intermediateOutput =
+            filterFamApplyConvolution(l->convFilter,i);
+        ImgFam * maxPoolOutput=imgFamDownSampleMax(intermediateOutput,
+                                                   l->downSamplePoolSize,
+                                                   l->downSampleStride);
+        deleteImgFam(intermediateOutput);
+        return maxPoolOutput;
+    }
+    return filterFamApplyConvolutionMaxPool(l->convFilter,i,
+                                            l->downSamplePoolSize,
+                                            l->downSampleStride);
 }
 
 /**
@@ -67,10 +75,16 @@ ImgFam * layerPassImg(Layer*l,Img*i) {
  * @return output of i through l
  */
 ImgFam * layerPassImgFam(Layer*l,ImgFam*i) {
-    ImgFam * intermediateOutput =
-        filterFamApplyConvolutionOnFam(l->convFilter,i);
-    ImgFam * maxPoolOutput=imgFamDownSampleMax(intermediateOutput,
-                                               l->downSamplePoolSize,
-                                               l->downSampleStride);
-    return maxPoolOutput;
+    if (l->downSamplePoolSize<1 || l->downSampleStride<1) {
+        ImgFam * intermediateOutput =
+            filterFamApplyConvolutionOnFam(l->convFilter,i);
+        ImgFam * maxPoolOutput=imgFamDownSampleMax(intermediateOutput,
+                                                   l->downSamplePoolSize,
+                                                   l->downSampleStride);
+        deleteImgFam(intermediateOutput);
+        return maxPoolOutput;
+    }
+    return filterFamApplyConvolutionMaxPoolOnFam(l->convFilter,i,
+                                                 l->downSamplePoolSize,
+                                                 l->downSampleStride);
 }
@@ -0,0 +1,258 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "pool.h"
+
+/**
+ * @file pool.c
+ * @brief Implements the pool of threads defined in pool.h.
+ *
+ * Every thread of the pool owns a double ended queue of tasks. The
+ * main thread owns queue 0. A thread pushes and pops tasks at the
+ * bottom of its own queue and, when it is empty, steals the oldest
+ * task at the top of the queue of another thread. A thread waiting
+ * for the tasks it submitted runs tasks meanwhile, so tasks can
+ * submit tasks themselves.
+ */
+
+/**
+ * @brief Number of threads running tasks, main thread included.
+ *
+ * When left to 0 the environment variable CNN_THREADS is looked at,
+ * then the number of processors is used.
+ */
+int poolThreads=0;
+
+/**
+ * @brief A task waiting to be run.
+ */
+struct poolTask {
+    /** function to call */
+    PoolFunc func;
+    /** first argument of func */
+    void * arg;
+    /** second argument of func */
+    int i;
+    /** number of tasks of the same poolFor not finished yet */
+    int * remaining;
+};
+
+/**
+ * @brief Short name for 'struct poolTask'
+ */
+typedef struct poolTask PoolTask;
+
+/**
+ * @brief Queue of tasks owned by a thread.
+ */
+struct poolQueue {
+    /** protects the queue */
+    pthread_mutex_t lock;
+    /** circular buffer of capacity tasks */
+    PoolTask * tasks;
+    /** size of tasks */
+    int capacity;
+    /** index of the oldest task, the one stolen first */
+    long int top;
+    /** index after the newest task, the one run first by the owner */
+    long int bottom;
+};
+
+/**
+ * @brief Short name for 'struct poolQueue'
+ */
+typedef struct poolQueue PoolQueue;
+
+/** number of threads of the pool once started, 0 before */
+static int poolCount=0;
+/** one queue per thread */
+static PoolQueue * poolQueues=NULL;
+/** protects poolQueued */
+static pthread_mutex_t poolLock=PTHREAD_MUTEX_INITIALIZER;
+/** signaled when a task is queued or when a poolFor is over */
+static pthread_cond_t poolWake=PTHREAD_COND_INITIALIZER;
+/** number of tasks in all queues */
+static int poolQueued=0;
+/** index of the queue of the current thread */
+static __thread int poolSelf=0;
+
+/**
+ * @brief Tells how many threads run tasks.
+ *
+ * The first call resolves poolThreads when it is 0 or less.
+ * @return the number of threads, at least 1.
+ */
+int poolGetThreads() {
+    if (poolThreads<=0) {
+        char * e = getenv("CNN_THREADS");
+        if (e!=NULL && atoi(e)>0) {
+            poolThreads=atoi(e);
+        } else {
+            long int n=sysconf(_SC_NPROCESSORS_ONLN);
+            poolThreads=n>0?(int)n:1;
+        }
+    }
+    return poolThreads;
+}
+
+/**
+ * @brief Adds a task at the bottom of the queue of the current thread.
+ * @param t the task to add.
+ */
+static void poolPush(PoolTask*t) {
+    PoolQueue * q = &poolQueues[poolSelf];
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom-q->top==q->capacity) {
+        int capacity=2*q->capacity;
+        PoolTask * tasks = (PoolTask*)malloc(sizeof(PoolTask)*capacity);
+        for (long int k=q->top;k<q->bottom;++k) {
+            tasks[k%capacity]=q->tasks[k%q->capacity];
+        }
+        free(q->tasks);
+        q->tasks=tasks;
+        q->capacity=capacity;
+    }
+    q->tasks[q->bottom%q->capacity]=*t;
+    q->bottom++;
+    pthread_mutex_unlock(&q->lock);
+    pthread_mutex_lock(&poolLock);
+    poolQueued++;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolLock);
+}
+
+/**
+ * @brief Gets a task to run: the newest one of the queue of the
+ *        current thread or else the oldest one of another queue.
+ * @param t where the task is written.
+ * @return non zero if a task was found.
+ */
+static int poolTake(PoolTask*t) {
+    int found=0;
+    for (int k=0;k<poolCount && !found;++k) {
+        PoolQueue * q = &poolQueues[(poolSelf+k)%poolCount];
+        pthread_mutex_lock(&q->lock);
+        if (q->bottom>q->top) {
+            if (k==0) {
+                q->bottom--;
+                *t=q->tasks[q->bottom%q->capacity];
+            } else {
+                *t=q->tasks[q->top%q->capacity];
+                q->top++;
+            }
+            found=1;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (found) {
+        pthread_mutex_lock(&poolLock);
+        poolQueued--;
+        pthread_mutex_unlock(&poolLock);
+    }
+    return found;
+}
+
+/**
+ * @brief Runs a task and wakes up threads waiting for its poolFor
+ *        if it was the last one.
+ * @param t the task to run.
+ */
+static void poolRun(PoolTask*t) {
+    t->func(t->arg,t->i);
+    if (__atomic_sub_fetch(t->remaining,1,__ATOMIC_ACQ_REL)==0) {
+        pthread_mutex_lock(&poolLock);
+        pthread_cond_broadcast(&poolWake);
+        pthread_mutex_unlock(&poolLock);
+    }
+}
+
+/**
+ * @brief Main loop of the threads of the pool.
+ * @param arg index of the queue of the thread.
+ * @return never returns.
+ */
+static void * poolWorker(void*arg) {
+    poolSelf=(int)(intptr_t)arg;
+    for (;;) {
+        PoolTask t;
+        if (poolTake(&t)) {
+            poolRun(&t);
+            continue;
+        }
+        pthread_mutex_lock(&poolLock);
+        while (poolQueued==0)
+            pthread_cond_wait(&poolWake,&poolLock);
+        pthread_mutex_unlock(&poolLock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Creates the queues and starts the threads of the pool.
+ *
+ * Threads are never stopped, they wait for tasks until the program
+ * exits.
+ */
+static void poolStart() {
+    static pthread_mutex_t startLock=PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&startLock);
+    if (poolCount==0) {
+        int n=poolGetThreads();
+        PoolQueue * queues = (PoolQueue*)malloc(sizeof(PoolQueue)*n);
+        for (int k=0;k<n;++k) {
+            pthread_mutex_init(&queues[k].lock,NULL);
+            queues[k].capacity=64;
+            queues[k].tasks=(PoolTask*)malloc(sizeof(PoolTask)*64);
+            queues[k].top=0;
+            queues[k].bottom=0;
+        }
+        poolQueues=queues;
+        poolCount=n;
+        for (int k=1;k<n;++k) {
+            pthread_t thread;
+            if (pthread_create(&thread,NULL,poolWorker,(void*)(intptr_t)k))
+                ERROR("Could not create thread.","");
+            pthread_detach(thread);
+        }
+    }
+    pthread_mutex_unlock(&startLock);
+}
+
+/**
+ * @brief Runs func(arg,i) for i from 0 to n-1 on the threads of the
+ *        pool and waits for all of them to be over.
+ *
+ * Calls can be nested: func can call poolFor itself. With a single
+ * thread calls are made in order by the current thread.
+ * @param n number of tasks.
+ * @param func function to run.
+ * @param arg first argument given to func.
+ */
+void poolFor(int n,PoolFunc func,void*arg) {
+    if (n<=0) return;
+    if (n==1 || poolGetThreads()<=1) {
+        for (int i=0;i<n;++i) {
+            func(arg,i);
+        }
+        return;
+    }
+    poolStart();
+    int remaining=n;
+    // pushed backwards so that the current thread runs them in order
+    for (int i=n-1;i>=0;--i) {
+        PoolTask t = {func,arg,i,&remaining};
+        poolPush(&t);
+    }
+    while (__atomic_load_n(&remaining,__ATOMIC_ACQUIRE)>0) {
+        PoolTask t;
+        if (poolTake(&t)) {
+            poolRun(&t);
+            continue;
+        }
+        pthread_mutex_lock(&poolLock);
+        while (poolQueued==0 &&
+               __atomic_load_n(&remaining,__ATOMIC_ACQUIRE)>0)
+            pthread_cond_wait(&poolWake,&poolLock);
+        pthread_mutex_unlock(&poolLock);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef POOL_H
+#define POOL_H
+
+/**
+ * @file pool.h
+ * @brief Header of the pool of threads running the tasks of the
+ *        detection pipeline.
+ */
+
+#include "util.h"
+
+/**
+ * @brief Function run by a task of poolFor.
+ * @param arg argument given to poolFor.
+ * @param i index of the task, between 0 and the number of tasks.
+ */
+typedef void (*PoolFunc)(void*arg,int i);
+
+extern int poolThreads;
+
+int poolGetThreads();
+void poolFor(int n,PoolFunc func,void*arg);
+
+#endif
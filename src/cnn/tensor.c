@@ -0,0 +1,594 @@
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tensor.h"
+
+/**
+ * @file tensor.c
+ * @brief Implements the raw tensor files defined in tensor.h.
+ *
+ * Files are mapped privately and writable, so a picture read from a
+ * file can be changed like any other one: the pages changed are then
+ * copied by the kernel and the file is left as it is.
+ */
+
+/**
+ * @brief Rounds up an offset to a multiple of TENSOR_ALIGN.
+ */
+#define TENSOR_ROUND(x) (((x)+TENSOR_ALIGN-1)/TENSOR_ALIGN*TENSOR_ALIGN)
+
+/**
+ * @brief A directory and whether it holds tensor files, once looked
+ *        at.
+ */
+struct tensorDir {
+    /** the directory */
+    char * dir;
+    /** non zero if the directory holds tensor files */
+    int hasFiles;
+    /** next directory looked at */
+    struct tensorDir * next;
+};
+
+/** directories looked at so far */
+static struct tensorDir * tensorDirs=NULL;
+/** protects tensorDirs */
+static pthread_mutex_t tensorDirsLock=PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Gets the directory of a file.
+ * @param filename name of the file.
+ * @param dir where the directory is written.
+ * @param size size of dir.
+ */
+static void tensorDirName(char * filename,char * dir,size_t size) {
+    char * slash = strrchr(filename,'/');
+    if (slash==NULL)
+        snprintf(dir,size,".");
+    else
+        snprintf(dir,size,"%.*s",
+                 slash==filename?1:(int)(slash-filename),filename);
+}
+
+/**
+ * @brief Tells if the directory of a file holds tensor files.
+ *
+ * The directory is listed the first time it is looked at only, so
+ * that files saved with pictures or filters cost a single listing of
+ * their directory when there are none. Tensor files written later by
+ * other processes are not seen.
+ * @param filename name of the file.
+ * @param written non zero when a tensor file has just been written
+ *        in the directory.
+ * @return non zero if the directory holds tensor files.
+ */
+static int tensorDirHasFiles(char * filename,int written) {
+    char dir[1024];
+    tensorDirName(filename,dir,sizeof(dir));
+    pthread_mutex_lock(&tensorDirsLock);
+    struct tensorDir * t = tensorDirs;
+    while (t!=NULL && strcmp(t->dir,dir)!=0) t=t->next;
+    if (t==NULL) {
+        t=(struct tensorDir*)malloc(sizeof(struct tensorDir));
+        t->dir=stringCopy(dir);
+        t->hasFiles=0;
+        DIR * d = written?NULL:opendir(dir);
+        struct dirent * e;
+        while (d!=NULL && !t->hasFiles && (e=readdir(d))!=NULL) {
+            size_t n=strlen(e->d_name);
+            t->hasFiles=n>7 && strcmp(e->d_name+n-7,".tensor")==0;
+        }
+        if (d!=NULL) closedir(d);
+        t->next=tensorDirs;
+        tensorDirs=t;
+    }
+    if (written) t->hasFiles=1;
+    int answer=t->hasFiles;
+    pthread_mutex_unlock(&tensorDirsLock);
+    return answer;
+}
+
+/**
+ * @brief Gets the size and modification time of a file.
+ * @param filename name of the file.
+ * @param size where the size in bytes is written.
+ * @param time where the modification time in nanoseconds is written.
+ * @return 0 on success, non zero if the file can not be looked at.
+ */
+static int tensorStamp(char * filename,int64_t * size,int64_t * time) {
+    struct stat st;
+    if (stat(filename,&st)!=0) return 1;
+    *size=st.st_size;
+    *time=(int64_t)st.st_mtim.tv_sec*1000000000+st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/**
+ * @brief Tells if a file is a tensor file from its first bytes.
+ * @param filename name of the file.
+ * @return non zero for a tensor file.
+ */
+int tensorIsFile(char * filename) {
+    char magic[sizeof(TENSOR_MAGIC)-1];
+    FILE * f = fopen(filename,"rb");
+    if (f==NULL) return 0;
+    int answer=fread(magic,1,sizeof(magic),f)==sizeof(magic) &&
+        memcmp(magic,TENSOR_MAGIC,sizeof(magic))==0;
+    fclose(f);
+    return answer;
+}
+
+/**
+ * @brief Tells if the png file a record was saved with changed since.
+ *
+ * Nothing is looked at when the directory of the tensor file did not
+ * change since it was written: png files are written aside then
+ * renamed by imgWritePng, so a png file changed since would have
+ * changed the directory. A record whose png file was removed is not
+ * stale: the tensor file is then all there is.
+ * @param map a map.
+ * @param i index of the record.
+ * @param source name of the png file of the record.
+ * @return non zero if the record must not be used.
+ */
+int tensorIsStale(TensorMap * map,int i,char * source) {
+    if (map->fresh) return 0;
+    const struct tensorRecord * r = &map->records[i];
+    int64_t size,time;
+    if (tensorStamp(source,&size,&time)) return 0;
+    return size!=r->sourceSize || time!=r->sourceTime;
+}
+
+/**
+ * @brief Tells if the png files a familly of records was saved with
+ *        changed since.
+ *
+ * The familly is stale when one of its records is, see tensorIsStale,
+ * or when it has more png files than records. The answer is kept in
+ * the map, so that a familly is looked at once per map.
+ * @param map a map.
+ * @param first index of the first record of the familly.
+ * @param count number of records of the familly.
+ * @param basename base name of the familly, the png file of record
+ *        first+i is basename_i.png.
+ * @return non zero if the familly must not be used.
+ */
+int tensorFamilyIsStale(TensorMap * map,int first,int count,
+                        char * basename) {
+    if (map->fresh) return 0;
+    int known=__atomic_load_n(&map->stale[first],__ATOMIC_RELAXED);
+    if (known) return known==2;
+    char png[strlen(basename)+16];
+    // a png file added after the familly was saved makes it stale
+    snprintf(png,sizeof(png),"%s_%d.png",basename,count);
+    int answer=access(png,F_OK)==0;
+    for (int i=0;i<count && !answer;++i) {
+        snprintf(png,sizeof(png),"%s_%d.png",basename,i);
+        answer=tensorIsStale(map,first+i,png);
+    }
+    __atomic_store_n(&map->stale[first],answer?2:1,__ATOMIC_RELAXED);
+    return answer;
+}
+
+/**
+ * @brief Tells if an offset of a record does not point to a string
+ *        ending inside the mapping.
+ * @param base start of the mapping.
+ * @param size size of the mapping.
+ * @param offset the offset, 0 for no string.
+ * @return non zero for a wrong offset.
+ */
+static int tensorBadString(const unsigned char * base,size_t size,
+                           uint64_t offset) {
+    return offset!=0 &&
+        (offset>=size || memchr(base+offset,0,size-offset)==NULL);
+}
+
+/**
+ * @brief Maps a tensor file in memory.
+ *
+ * Leaves with an error if the file can not be mapped or is not a
+ * valid tensor file.
+ * @param filename name of the file.
+ * @return the map, to be deleted with deleteTensorMap.
+ */
+TensorMap * newTensorMap(char * filename) {
+    int fd = open(filename,O_RDONLY);
+    if (fd<0) ERROR("can't open ",filename);
+    struct stat st;
+    if (fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(struct tensorHeader)) {
+        close(fd);
+        ERROR("not a tensor file: ",filename);
+    }
+    size_t size=st.st_size;
+    void * base = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (base==MAP_FAILED) ERROR("could not map ",filename);
+    const struct tensorHeader * h = (const struct tensorHeader*)base;
+    if (memcmp(h->magic,TENSOR_MAGIC,sizeof(TENSOR_MAGIC)-1)!=0 ||
+        h->byteOrder!=0x01020304 || h->count<0 ||
+        (size-sizeof(struct tensorHeader))/sizeof(struct tensorRecord)<
+        (size_t)h->count) {
+        munmap(base,size);
+        ERROR("not a tensor file of this machine: ",filename);
+    }
+    const struct tensorRecord * r =
+        (const struct tensorRecord*)(h+1);
+    for (int i=0;i<h->count;++i,++r) {
+        uint64_t pixels=(uint64_t)r->width*r->height;
+        uint64_t sep=(uint64_t)r->sepRank*(r->width+r->height)*sizeof(float);
+        if ((r->type!=TENSOR_IMG && r->type!=TENSOR_FILTER) ||
+            r->width<1 || r->height<1 || r->sepRank<0 ||
+            r->offset%TENSOR_ALIGN!=0 ||
+            r->offset>size || pixels>size-r->offset ||
+            (sep>0 && (r->sepOffset%sizeof(float)!=0 ||
+                       r->sepOffset>size || sep>size-r->sepOffset)) ||
+            tensorBadString(base,size,r->dataOffset) ||
+            tensorBadString(base,size,r->nameOffset)) {
+            munmap(base,size);
+            ERROR("corrupted tensor file: ",filename);
+        }
+    }
+    TensorMap * answer = (TensorMap*)malloc(sizeof(TensorMap));
+    answer->base=(unsigned char*)base;
+    answer->size=size;
+    answer->count=h->count;
+    answer->records=(const struct tensorRecord*)(h+1);
+    answer->refs=1;
+    // tensorWrite gives the file the modification time of its directory
+    char dir[1024];
+    struct stat dst;
+    tensorDirName(filename,dir,sizeof(dir));
+    answer->fresh=stat(dir,&dst)==0 &&
+        (st.st_mtim.tv_sec>dst.st_mtim.tv_sec ||
+         (st.st_mtim.tv_sec==dst.st_mtim.tv_sec &&
+          st.st_mtim.tv_nsec>=dst.st_mtim.tv_nsec));
+    answer->stale=(unsigned char*)calloc(h->count+1,1);
+    return answer;
+}
+
+/**
+ * @brief Maps a tensor file when there is one.
+ *
+ * The file is only looked for when its directory held tensor files
+ * the first time it was looked at, see tensorDirHasFiles.
+ * @param filename name of the file.
+ * @return the map, to be deleted with deleteTensorMap, NULL if there
+ *         is no such tensor file.
+ */
+TensorMap * newTensorMapFound(char * filename) {
+    if (!tensorDirHasFiles(filename,0) || !tensorIsFile(filename))
+        return NULL;
+    return newTensorMap(filename);
+}
+
+/**
+ * @brief Drops a reference to a map: the one of the caller of
+ *        newTensorMap, or the one of a picture deleted by deleteImg.
+ *
+ * The file is unmapped when no reference is left.
+ * @param map a map.
+ */
+void deleteTensorMap(TensorMap * map) {
+    if (map==NULL) return;
+    if (__atomic_sub_fetch(&map->refs,1,__ATOMIC_ACQ_REL)>0) return;
+    munmap(map->base,map->size);
+    free(map->stale);
+    free(map);
+}
+
+/**
+ * @brief Gets the picture of a record, without copying its pixels.
+ * @param map a map.
+ * @param i index of the record.
+ * @return a newly allocated picture whose pixels are in the map, it
+ *         keeps the map alive until it is deleted.
+ */
+Img * tensorMapImg(TensorMap * map,int i) {
+    if (i<0 || i>=map->count) ERROR("no such record in tensor file","");
+    const struct tensorRecord * r = &map->records[i];
+    Img * answer = (Img*)malloc(sizeof(struct img));
+    answer->width=r->width;
+    answer->height=r->height;
+    answer->data=map->base+r->offset;
+    answer->map=map;
+    __atomic_add_fetch(&map->refs,1,__ATOMIC_RELAXED);
+    return answer;
+}
+
+/**
+ * @brief Gets the pictures of all the records of a map.
+ * @param map a map.
+ * @return a newly allocated familly, see tensorMapImg.
+ */
+ImgFam * tensorMapImgFam(TensorMap * map) {
+    ImgFam * answer = newImgFam(map->count);
+    for (int i=0;i<map->count;++i) {
+        imgFamSetImg(answer,i,tensorMapImg(map,i));
+    }
+    return answer;
+}
+
+/**
+ * @brief Gets the filter of a record, without copying its pixels nor
+ *        computing its values again.
+ *
+ * The separable form is dropped when filterForceExact is set.
+ * @param map a map.
+ * @param i index of the record, which must be a filter.
+ * @return a newly allocated filter, see tensorMapImg.
+ */
+Filter * tensorMapFilter(TensorMap * map,int i) {
+    if (i<0 || i>=map->count || map->records[i].type!=TENSOR_FILTER)
+        ERROR("no such filter in tensor file","");
+    const struct tensorRecord * r = &map->records[i];
+    Filter * answer = newFilter(NULL,r->percent);
+    answer->img=tensorMapImg(map,i);
+    answer->weight=r->weight;
+    answer->threshold=r->threshold;
+    answer->maxVal=r->maxVal;
+    for (int diff=0;diff<2;++diff) {
+        answer->tapBound[diff]=r->tapBound[diff];
+        answer->tapCount[diff]=r->tapCount[diff];
+    }
+    answer->rescaleMul=r->rescaleMul;
+    answer->rescaleShift=r->rescaleShift;
+    if (r->sepRank>0 && !filterForceExact) {
+        const float * sep = (const float*)(map->base+r->sepOffset);
+        answer->sepRank=r->sepRank;
+        answer->sepCol=(float*)malloc(sizeof(float)*r->sepRank*r->height);
+        answer->sepRow=(float*)malloc(sizeof(float)*r->sepRank*r->width);
+        memcpy(answer->sepCol,sep,sizeof(float)*r->sepRank*r->height);
+        memcpy(answer->sepRow,sep+r->sepRank*r->height,
+               sizeof(float)*r->sepRank*r->width);
+    }
+    if (r->dataOffset!=0) {
+        answer->data=stringCopy((char*)map->base+r->dataOffset);
+    }
+    return answer;
+}
+
+/**
+ * @brief Looks for the records of a familly.
+ * @param map a map.
+ * @param name name of the familly.
+ * @param count where the number of records of the familly is written.
+ * @return index of the first record of the familly, -1 if the map has
+ *         no such familly.
+ */
+int tensorFindFamily(TensorMap * map,const char * name,int * count) {
+    int first=0;
+    while (first<map->count &&
+           (map->records[first].nameOffset==0 ||
+            strcmp((char*)map->base+map->records[first].nameOffset,
+                   name)!=0)) {
+        ++first;
+    }
+    if (first==map->count) return -1;
+    int last=first+1;
+    while (last<map->count &&
+           map->records[last].nameOffset!=0 &&
+           strcmp((char*)map->base+map->records[last].nameOffset,
+                  name)==0) {
+        ++last;
+    }
+    *count=last-first;
+    return first;
+}
+
+/**
+ * @brief Gets the filters of records following each other.
+ * @param map a map.
+ * @param first index of the first record.
+ * @param count number of records.
+ * @return a newly allocated familly, see tensorMapFilter.
+ * @see tensorFindFamily
+ */
+FilterFam * tensorMapFilterFam(TensorMap * map,int first,int count) {
+    FilterFam * answer = newFilterFam(count);
+    for (int i=0;i<count;++i) {
+        filterFamSetFilter(answer,i,tensorMapFilter(map,first+i));
+    }
+    return answer;
+}
+
+/**
+ * @brief Writes zeros up to an offset.
+ * @param f file written.
+ * @param at offset reached so far, updated.
+ * @param to offset to reach.
+ */
+static void tensorPad(FILE * f,uint64_t * at,uint64_t to) {
+    static const char zeros[TENSOR_ALIGN]={0};
+    while (*at<to) {
+        uint64_t n=to-*at;
+        if (n>TENSOR_ALIGN) n=TENSOR_ALIGN;
+        fwrite(zeros,1,n,f);
+        *at+=n;
+    }
+}
+
+/**
+ * @brief Writes pictures or filters to a tensor file.
+ * @param filename name of the file.
+ * @param count number of records.
+ * @param imgs the pictures, NULL when filters are written.
+ * @param filters the filters, NULL when pictures are written.
+ * @param names the name of the familly of each record, NULL when
+ *        records have no name. Records following each other with the
+ *        same pointer share their name in the file.
+ * @param sources the png file each record is saved with, NULL when
+ *        records have none.
+ */
+static void tensorWrite(char * filename,int count,Img ** imgs,
+                        Filter ** filters,char ** names,char ** sources)
+{
+    struct tensorHeader h;
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,TENSOR_MAGIC,sizeof(TENSOR_MAGIC)-1);
+    h.byteOrder=0x01020304;
+    h.count=count;
+    struct tensorRecord * records =
+        (struct tensorRecord*)calloc(count>0?count:1,
+                                     sizeof(struct tensorRecord));
+    uint64_t at=sizeof(h)+sizeof(struct tensorRecord)*count;
+    for (int i=0;i<count;++i) {
+        struct tensorRecord * r = &records[i];
+        Img * img = filters!=NULL?filters[i]->img:imgs[i];
+        r->type=filters!=NULL?TENSOR_FILTER:TENSOR_IMG;
+        r->width=img->width;
+        r->height=img->height;
+        if (sources!=NULL)
+            tensorStamp(sources[i],&r->sourceSize,&r->sourceTime);
+        at=TENSOR_ROUND(at);
+        r->offset=at;
+        at+=(uint64_t)img->width*img->height;
+        if (names!=NULL) {
+            if (i>0 && names[i]==names[i-1]) {
+                r->nameOffset=records[i-1].nameOffset;
+            } else {
+                r->nameOffset=at;
+                at+=strlen(names[i])+1;
+            }
+        }
+        if (filters==NULL) continue;
+        Filter * f = filters[i];
+        r->percent=f->percent;
+        r->weight=f->weight;
+        r->threshold=f->threshold;
+        r->maxVal=f->maxVal;
+        for (int diff=0;diff<2;++diff) {
+            r->tapBound[diff]=f->tapBound[diff];
+            r->tapCount[diff]=f->tapCount[diff];
+        }
+        r->rescaleMul=f->rescaleMul;
+        r->rescaleShift=f->rescaleShift;
+        r->sepRank=f->sepRank;
+        if (f->sepRank>0) {
+            at=TENSOR_ROUND(at);
+            r->sepOffset=at;
+            at+=sizeof(float)*f->sepRank*(img->width+img->height);
+        }
+        if (f->data!=NULL) {
+            r->dataOffset=at;
+            at+=strlen(f->data)+1;
+        }
+    }
+    // the file is written aside then renamed, so that maps of the file
+    // it replaces keep their pages, under a name of its own for each
+    // process writing it
+    char tmp[1024];
+    snprintf(tmp,sizeof(tmp),"%s.%ld.tmp",filename,(long)getpid());
+    FILE * f = fopen(tmp,"wb");
+    if (f==NULL) ERROR("could not open file ",tmp);
+    fwrite(&h,sizeof(h),1,f);
+    fwrite(records,sizeof(struct tensorRecord),count,f);
+    at=sizeof(h)+sizeof(struct tensorRecord)*count;
+    for (int i=0;i<count;++i) {
+        struct tensorRecord * r = &records[i];
+        Img * img = filters!=NULL?filters[i]->img:imgs[i];
+        tensorPad(f,&at,r->offset);
+        fwrite(img->data,1,(size_t)img->width*img->height,f);
+        at+=(uint64_t)img->width*img->height;
+        if (r->nameOffset==at) {
+            size_t n=strlen(names[i])+1;
+            fwrite(names[i],1,n,f);
+            at+=n;
+        }
+        if (filters==NULL) continue;
+        if (r->sepRank>0) {
+            tensorPad(f,&at,r->sepOffset);
+            fwrite(filters[i]->sepCol,sizeof(float),
+                   r->sepRank*img->height,f);
+            fwrite(filters[i]->sepRow,sizeof(float),
+                   r->sepRank*img->width,f);
+            at+=sizeof(float)*r->sepRank*(img->width+img->height);
+        }
+        if (r->dataOffset!=0) {
+            size_t n=strlen(filters[i]->data)+1;
+            fwrite(filters[i]->data,1,n,f);
+            at+=n;
+        }
+    }
+    free(records);
+    if (ferror(f) | fclose(f)) ERROR("could not write file ",tmp);
+    if (rename(tmp,filename)!=0) ERROR("could not write file ",filename);
+    // the file gets the modification time of its directory, so that a
+    // later change of the directory tells that png files may have
+    // changed, see newTensorMap
+    char dir[1024];
+    struct stat st;
+    tensorDirName(filename,dir,sizeof(dir));
+    if (stat(dir,&st)==0) {
+        struct timespec times[2]={{0,UTIME_OMIT},st.st_mtim};
+        utimensat(AT_FDCWD,filename,times,0);
+    }
+    tensorDirHasFiles(filename,1);
+}
+
+/**
+ * @brief Writes a picture to a tensor file.
+ * @param img the picture.
+ * @param filename name of the file.
+ * @see tensorMapImg
+ */
+void tensorWriteImg(Img * img,char * filename) {
+    tensorWrite(filename,1,&img,NULL,NULL,NULL);
+}
+
+/**
+ * @brief Writes a familly of pictures to a tensor file, one record
+ *        per picture.
+ * @param imgFam the familly.
+ * @param filename name of the file.
+ * @param sources the png file of each picture.
+ * @see tensorMapImgFam
+ */
+void tensorWriteImgFam(ImgFam * imgFam,char * filename,char ** sources) {
+    tensorWrite(filename,imgFam->count,imgFam->imgs,NULL,NULL,sources);
+}
+
+/**
+ * @brief Writes a filter to a tensor file.
+ * @param filter the filter.
+ * @param filename name of the file.
+ * @param source the png file of the filter.
+ * @see tensorMapFilter
+ */
+void tensorWriteFilter(Filter * filter,char * filename,char * source) {
+    tensorWrite(filename,1,NULL,&filter,NULL,&source);
+}
+
+/**
+ * @brief Writes families of filters to a single tensor file, each
+ *        record being named after its familly.
+ * @param filename name of the file.
+ * @param count number of families.
+ * @param fams the families.
+ * @param names the names of the families.
+ * @param sources the png file of each filter, families one after the
+ *        other.
+ * @see tensorFindFamily
+ * @see tensorMapFilterFam
+ */
+void tensorWriteFilterFams(char * filename,int count,FilterFam ** fams,
+                           char ** names,char ** sources)
+{
+    int total=0;
+    for (int i=0;i<count;++i) total+=fams[i]->count;
+    Filter ** filters = (Filter**)malloc(sizeof(Filter*)*(total>0?total:1));
+    char ** recordNames = (char**)malloc(sizeof(char*)*(total>0?total:1));
+    int k=0;
+    for (int i=0;i<count;++i) {
+        for (int j=0;j<fams[i]->count;++j,++k) {
+            filters[k]=fams[i]->filters[j];
+            recordNames[k]=names[i];
+        }
+    }
+    tensorWrite(filename,total,NULL,filters,recordNames,sources);
+    free(recordNames);
+    free(filters);
+}
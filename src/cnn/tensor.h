@@ -0,0 +1,162 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+/**
+ * @file tensor.h
+ * @brief Header of the raw tensor files, which hold pictures and
+ *        filters as they are in memory so that they can be mapped
+ *        instead of decoded.
+ *
+ * A file starts with a struct tensorHeader, followed by count struct
+ * tensorRecord, then by the pixels of each record. Pixels start on a
+ * multiple of TENSOR_ALIGN bytes. Integers are in the byte order of
+ * the machine which wrote the file, files are meant to be read on the
+ * same machine.
+ */
+
+#include <stdint.h>
+#include "img.h"
+#include "imgfam.h"
+#include "filter.h"
+#include "filterfam.h"
+
+/**
+ * @brief First bytes of a tensor file.
+ */
+#define TENSOR_MAGIC "cnn tensors 2\n"
+
+/**
+ * @brief Alignment in bytes of the pixels in a tensor file, the size
+ *        of a cache line.
+ */
+#define TENSOR_ALIGN 64
+
+/**
+ * @brief What a record of a tensor file holds.
+ */
+enum tensorType {
+    /** a picture */
+    TENSOR_IMG=1,
+    /** a filter: its picture and the values computed from it */
+    TENSOR_FILTER=2
+};
+
+/**
+ * @brief Start of a tensor file, TENSOR_ALIGN bytes long.
+ */
+struct tensorHeader {
+    /** TENSOR_MAGIC padded with zeros */
+    char magic[16];
+    /** 0x01020304, to tell the byte order of the file */
+    uint32_t byteOrder;
+    /** number of records */
+    int32_t count;
+    /** zeros */
+    int32_t reserved[10];
+};
+
+/**
+ * @brief A picture or a filter in a tensor file, 144 bytes long.
+ *
+ * Values of the filter are those of struct filter, so that a filter
+ * is used as soon as it is mapped. The size and modification time of
+ * the png file the record was saved with tell when the png file
+ * changed since, see tensorIsStale. They are only looked at when the
+ * directory of the file changed since it was written.
+ */
+struct tensorRecord {
+    /** one of enum tensorType */
+    int32_t type;
+    /** width of the picture */
+    int32_t width;
+    /** height of the picture */
+    int32_t height;
+    /** percent of the filter */
+    int32_t percent;
+    /** sepRank of the filter */
+    int32_t sepRank;
+    /** rescaleShift of the filter */
+    int32_t rescaleShift;
+    /** weight of the filter */
+    int64_t weight;
+    /** threshold of the filter */
+    int64_t threshold;
+    /** maxVal of the filter */
+    int64_t maxVal;
+    /** tapBound of the filter */
+    int64_t tapBound[2];
+    /** tapCount of the filter */
+    int64_t tapCount[2];
+    /** rescaleMul of the filter */
+    uint64_t rescaleMul;
+    /** offset in the file of the width*height pixels */
+    uint64_t offset;
+    /** offset in the file of the sepCol then sepRow values of the
+        filter, as floats */
+    uint64_t sepOffset;
+    /** offset in the file of the data string of the filter, 0 when
+        it has none */
+    uint64_t dataOffset;
+    /** offset in the file of the name of the familly of the record, 0
+        when it has none. Records of a familly follow each other. */
+    uint64_t nameOffset;
+    /** size in bytes of the png file of the record when it was
+        written, 0 when it has none */
+    int64_t sourceSize;
+    /** modification time in nanoseconds of the png file of the
+        record when it was written */
+    int64_t sourceTime;
+    /** zeros */
+    int64_t reserved;
+};
+
+/**
+ * @brief A tensor file mapped in memory.
+ *
+ * The mapping is released when the last picture using it and the map
+ * itself are deleted.
+ */
+struct tensorMap {
+    /** start of the mapping */
+    unsigned char * base;
+    /** size of the mapping in bytes */
+    size_t size;
+    /** number of records */
+    int count;
+    /** the records, in the mapping */
+    const struct tensorRecord * records;
+    /** number of pictures using the mapping, plus one until
+        deleteTensorMap is called */
+    int refs;
+    /** non zero if the directory of the file did not change since
+        the file was written */
+    int fresh;
+    /** for the first record of each familly looked at by
+        tensorFamilyIsStale, 1 if it can be used, 2 if it is stale */
+    unsigned char * stale;
+};
+
+/**
+ * @brief Short name for 'struct tensorMap'
+ */
+typedef struct tensorMap TensorMap;
+
+TensorMap * newTensorMap(char * filename);
+TensorMap * newTensorMapFound(char * filename);
+void deleteTensorMap(TensorMap * map);
+Img * tensorMapImg(TensorMap * map,int i);
+ImgFam * tensorMapImgFam(TensorMap * map);
+Filter * tensorMapFilter(TensorMap * map,int i);
+int tensorFindFamily(TensorMap * map,const char * name,int * count);
+FilterFam * tensorMapFilterFam(TensorMap * map,int first,int count);
+int tensorIsFile(char * filename);
+int tensorIsStale(TensorMap * map,int i,char * source);
+int tensorFamilyIsStale(TensorMap * map,int first,int count,
+                        char * basename);
+void tensorWriteImg(Img * img,char * filename);
+void tensorWriteImgFam(ImgFam * imgFam,char * filename,char ** sources);
+void tensorWriteFilter(Filter * filter,char * filename,char * source);
+void tensorWriteFilterFams(char * filename,int count,FilterFam ** fams,
+                           char ** names,char ** sources);
+
+#endif
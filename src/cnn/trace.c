@@ -0,0 +1,222 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include "trace.h"
+
+/**
+ * @file trace.c
+ * @brief Implements the trace points defined in trace.h.
+ *
+ * traceImg copies the picture and puts it at the end of a ring buffer.
+ * A background thread, started by the first traced picture, takes the
+ * pictures at the start of the ring buffer and encodes them as png
+ * files, so the thread tracing does not pay for the encoding. When
+ * the ring buffer is full traceImg waits for a free slot, so no
+ * picture is lost. Pictures not written yet are written when the
+ * process exits.
+ */
+
+/**
+ * @brief Level of the trace points enabled, one of enum traceLevel.
+ *
+ * When left to a negative value the environment variable CNN_TRACE is
+ * looked at, then trace points are disabled.
+ */
+int traceLevel=-1;
+
+/**
+ * @brief Number of pictures waiting to be written the ring buffer holds.
+ */
+#define TRACE_RING_SIZE 32
+
+/**
+ * @brief zlib compression level of the pictures traced, which are
+ *        written with IMG_PNG_FILTER_UP: level 1 with that filter is
+ *        the fastest, see imgWritePng.
+ */
+#define TRACE_PNG_LEVEL 1
+
+/**
+ * @brief Size of the name of a file written by the trace points.
+ */
+#define TRACE_NAME_SIZE 256
+
+/**
+ * @brief A picture waiting to be written.
+ */
+struct traceEntry {
+    /** copy of the traced picture */
+    Img * img;
+    /** file where img is written */
+    char name[TRACE_NAME_SIZE];
+};
+
+/** pictures waiting to be written */
+static struct traceEntry traceRing[TRACE_RING_SIZE];
+/** index of the next picture to write */
+static long int traceHead=0;
+/** index after the last picture queued */
+static long int traceTail=0;
+/** non zero once the writer is started */
+static int traceStarted=0;
+/** non zero when the writer should leave once the ring is empty */
+static int traceStopping=0;
+/** thread writing the pictures */
+static pthread_t traceWriter;
+/** protects the ring buffer */
+static pthread_mutex_t traceLock=PTHREAD_MUTEX_INITIALIZER;
+/** signaled when a picture is queued or when the writer should leave */
+static pthread_cond_t traceQueued=PTHREAD_COND_INITIALIZER;
+/** signaled when a picture is written */
+static pthread_cond_t traceWritten=PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Tells the level of the trace points enabled.
+ *
+ * The first call resolves traceLevel when it is negative.
+ * @return one of enum traceLevel.
+ */
+int traceGetLevel() {
+    if (traceLevel<0) {
+        char * e = getenv("CNN_TRACE");
+        traceLevel=(e!=NULL && *e)?traceParseLevel(e):TRACE_OFF;
+    }
+    return traceLevel;
+}
+
+/**
+ * @brief Reads a level of trace points.
+ * @param s off, info, data, all or a number.
+ * @return one of enum traceLevel, leaves with an error if s is not a
+ *         level.
+ */
+int traceParseLevel(char*s) {
+    if (strcmp(s,"off")==0) return TRACE_OFF;
+    if (strcmp(s,"info")==0) return TRACE_INFO;
+    if (strcmp(s,"data")==0) return TRACE_DATA;
+    if (strcmp(s,"all")==0) return TRACE_ALL;
+    if (*s>='0' && *s<='9') {
+        int level=atoi(s);
+        return level>TRACE_ALL?TRACE_ALL:level;
+    }
+    ERROR("unknown trace level: ",s);
+}
+
+/**
+ * @brief Writes the message of a trace point on the standard error.
+ * @param file source file of the trace point.
+ * @param line line of the trace point.
+ * @param name name of the trace point.
+ * @param fmt format of the message, as for printf.
+ */
+void traceText(const char*file,int line,const char*name,
+               const char*fmt,...) {
+    char message[TRACE_NAME_SIZE];
+    va_list ap;
+    va_start(ap,fmt);
+    vsnprintf(message,TRACE_NAME_SIZE,fmt,ap);
+    va_end(ap);
+    fprintf(stderr,"%s:%d: [%s] %s\n",file,line,name,message);
+}
+
+/**
+ * @brief Body of the thread writing the traced pictures.
+ * @param arg not used.
+ * @return NULL.
+ */
+static void * traceWriterRun(void*arg) {
+    (void)arg;
+    pthread_mutex_lock(&traceLock);
+    for (;;) {
+        while (traceHead==traceTail && !traceStopping) {
+            pthread_cond_wait(&traceQueued,&traceLock);
+        }
+        if (traceHead==traceTail) break;
+        struct traceEntry * e = &traceRing[traceHead%TRACE_RING_SIZE];
+        // the slot stays busy until the picture is written
+        pthread_mutex_unlock(&traceLock);
+        imgWritePng(e->img,e->name,TRACE_PNG_LEVEL,IMG_PNG_FILTER_UP);
+        deleteImg(e->img);
+        pthread_mutex_lock(&traceLock);
+        traceHead++;
+        pthread_cond_broadcast(&traceWritten);
+    }
+    pthread_mutex_unlock(&traceLock);
+    return NULL;
+}
+
+/**
+ * @brief Waits for the traced pictures to be written.
+ */
+void traceFlush() {
+    pthread_mutex_lock(&traceLock);
+    if (!traceStarted || pthread_equal(pthread_self(),traceWriter)) {
+        pthread_mutex_unlock(&traceLock);
+        return;
+    }
+    while (traceHead!=traceTail) {
+        pthread_cond_wait(&traceWritten,&traceLock);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+/**
+ * @brief Writes the pictures left and stops the writer, called when
+ *        the process exits.
+ */
+static void traceStop() {
+    pthread_mutex_lock(&traceLock);
+    if (!traceStarted || pthread_equal(pthread_self(),traceWriter)) {
+        pthread_mutex_unlock(&traceLock);
+        return;
+    }
+    traceStopping=1;
+    pthread_cond_signal(&traceQueued);
+    pthread_mutex_unlock(&traceLock);
+    pthread_join(traceWriter,NULL);
+}
+
+/**
+ * @brief Queues a picture to be written as a png file in the
+ *        directory given by CNN_TRACE_DIR, the current one by default.
+ * @param img picture traced, copied so it can be changed or deleted
+ *        right after.
+ * @param fmt name of the file without extension, as for printf.
+ */
+void traceImg(Img*img,const char*fmt,...) {
+    char name[TRACE_NAME_SIZE];
+    char * dir = getenv("CNN_TRACE_DIR");
+    int n=snprintf(name,TRACE_NAME_SIZE,"%s/",
+                   (dir!=NULL && *dir)?dir:".");
+    if (n<0 || n>=TRACE_NAME_SIZE) {
+        WARNING("trace directory name too long: ",dir);
+        return;
+    }
+    va_list ap;
+    va_start(ap,fmt);
+    int m=vsnprintf(name+n,TRACE_NAME_SIZE-n,fmt,ap);
+    va_end(ap);
+    if (m<0 || n+m+5>TRACE_NAME_SIZE) {
+        WARNING("trace name too long: ",name);
+        return;
+    }
+    strcat(name,".png");
+    Img * copy = newImgCopy(img);
+    pthread_mutex_lock(&traceLock);
+    if (!traceStarted) {
+        if (pthread_create(&traceWriter,NULL,traceWriterRun,NULL)!=0) {
+            pthread_mutex_unlock(&traceLock);
+            ERROR("could not start the trace writer","");
+        }
+        traceStarted=1;
+        atexit(traceStop);
+    }
+    while (traceTail-traceHead==TRACE_RING_SIZE) {
+        pthread_cond_wait(&traceWritten,&traceLock);
+    }
+    struct traceEntry * e = &traceRing[traceTail%TRACE_RING_SIZE];
+    e->img=copy;
+    strcpy(e->name,name);
+    traceTail++;
+    pthread_cond_signal(&traceQueued);
+    pthread_mutex_unlock(&traceLock);
+}
@@ -0,0 +1,69 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * @file trace.h
+ * @brief Header of the trace points used to look at what the
+ *        detection pipeline computes.
+ *
+ * A trace point has a name and a level. It does something only when
+ * the level of traces is at least its own level, so a disabled trace
+ * point costs a comparison. Pictures are copied to a ring buffer and
+ * written as png files by a background thread.
+ */
+
+#include "img.h"
+
+/**
+ * @brief Levels of the trace points.
+ */
+enum traceLevel {
+    /** nothing is traced */
+    TRACE_OFF=0,
+    /** short messages: scores, positions, choices */
+    TRACE_INFO=1,
+    /** intermediate pictures and profiles */
+    TRACE_DATA=2,
+    /** everything, including the filters built */
+    TRACE_ALL=3
+};
+
+/**
+ * @brief Highest level of trace points compiled in. Building with
+ *        -DTRACE_MAX_LEVEL=0 removes every trace point.
+ */
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_ALL
+#endif
+
+extern int traceLevel;
+
+int traceGetLevel();
+int traceParseLevel(char*);
+void traceText(const char*file,int line,const char*name,
+               const char*fmt,...);
+void traceImg(Img*img,const char*fmt,...);
+void traceFlush();
+
+/**
+ * @brief Tells if trace points of a level are enabled.
+ */
+#define TRACE_ON(level) ((level)<=TRACE_MAX_LEVEL &&                    \
+                         (traceLevel<0?traceGetLevel():traceLevel)>=(level))
+
+/**
+ * @brief Trace point writing a message on the standard error, the
+ *        arguments after name are those of printf.
+ */
+#define TRACE(level,name,...) {if (TRACE_ON(level))                    \
+            traceText(__FILE__,__LINE__,name,__VA_ARGS__);}
+
+/**
+ * @brief Trace point writing a picture, the arguments after img are
+ *        those of printf and give the name of the file without
+ *        extension.
+ */
+#define TRACE_IMG(level,img,...) {if (TRACE_ON(level))                 \
+            traceImg(img,__VA_ARGS__);}
+
+#endif
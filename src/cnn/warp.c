@@ -0,0 +1,151 @@
+#include "warp.h"
+
+/**
+ * @file warp.c
+ * @brief Implements the sampling maps defined in warp.h.
+ *
+ * The cells of a grid are cut out of a picture by a homography from
+ * the unit square to the four corners of the grid, so that a skewed
+ * or slanted grid gives straight cells. The homography is evaluated
+ * once per pixel of the cells when the map is built. Applying the map
+ * is then a bilinear interpolation per pixel, reading the picture
+ * from top to bottom and writing in a buffer small enough to stay in
+ * cache.
+ */
+
+/**
+ * @brief Computes the homography from the unit square to a
+ *        quadrilateral.
+ *
+ * Point (u,v) of the square goes to
+ * ((m[0]u+m[1]v+m[2])/(m[6]u+m[7]v+1),(m[3]u+m[4]v+m[5])/(m[6]u+m[7]v+1)).
+ * @param corners x and y of the images of (0,0), (1,0), (1,1) and
+ *        (0,1): top left, top right, bottom right and bottom left
+ *        corners.
+ * @param m where the 8 coefficients are written.
+ */
+void warpHomography(const double * corners,double * m) {
+    double x0=corners[0],y0=corners[1];
+    double x1=corners[2],y1=corners[3];
+    double x2=corners[4],y2=corners[5];
+    double x3=corners[6],y3=corners[7];
+    double dx1=x1-x2,dx2=x3-x2,dx3=x0-x1+x2-x3;
+    double dy1=y1-y2,dy2=y3-y2,dy3=y0-y1+y2-y3;
+    double g=0,h=0;
+    double den=dx1*dy2-dx2*dy1;
+    // a parallelogram gives an affine map
+    if ((dx3!=0 || dy3!=0) && den!=0) {
+        g=(dx3*dy2-dx2*dy3)/den;
+        h=(dx1*dy3-dx3*dy1)/den;
+    }
+    m[0]=x1-x0+g*x1;
+    m[1]=x3-x0+h*x3;
+    m[2]=x0;
+    m[3]=y1-y0+g*y1;
+    m[4]=y3-y0+h*y3;
+    m[5]=y0;
+    m[6]=g;
+    m[7]=h;
+}
+
+/**
+ * @brief Builds the map cutting the cells of a grid out of pictures of
+ *        a given size.
+ *
+ * Cells are written one after the other, row by row, each one as size
+ * rows of size pixels. Pixels of the cells falling outside the picture
+ * read its border.
+ * @param width width of the pictures, at least 2.
+ * @param height height of the pictures, at least 2.
+ * @param corners corners of the grid as for warpHomography, in pixels.
+ * @param cells number of cells on each side of the grid.
+ * @param size number of pixels on each side of a cell.
+ * @param margin part of a cell left out on each side, 0.1 leaves the
+ *        lines of the grid out.
+ * @return a newly allocated map.
+ */
+Warp * newWarpCells(int width,
+                    int height,
+                    const double * corners,
+                    int cells,
+                    int size,
+                    double margin)
+{
+    if (width<2 || height<2) ERROR("picture too small to be warped","");
+    int n=cells*cells*size*size;
+    Warp * answer = (Warp*)malloc(sizeof(Warp));
+    answer->width=width;
+    answer->height=height;
+    answer->cells=cells;
+    answer->size=size;
+    answer->taps=(struct warpTap*)malloc(sizeof(struct warpTap)*(n>0?n:1));
+    struct warpTap * taps=(struct warpTap*)malloc(sizeof(struct warpTap)*
+                                                  (n>0?n:1));
+    int * rows=(int*)calloc(height+1,sizeof(int));
+    double m[8];
+    warpHomography(corners,m);
+    int xiMax=(width-1)*256-1;
+    int yiMax=(height-1)*256-1;
+    double step=(1-2*margin)/size;
+    int k=0;
+    for (int cy=0;cy<cells;++cy) {
+        for (int cx=0;cx<cells;++cx) {
+            for (int py=0;py<size;++py) {
+                double v=(cy+margin+(py+0.5)*step)/cells;
+                for (int px=0;px<size;++px,++k) {
+                    double u=(cx+margin+(px+0.5)*step)/cells;
+                    double w=m[6]*u+m[7]*v+1;
+                    int xi=(int)((m[0]*u+m[1]*v+m[2])/w*256);
+                    int yi=(int)((m[3]*u+m[4]*v+m[5])/w*256);
+                    if (xi<0) xi=0;
+                    if (xi>xiMax) xi=xiMax;
+                    if (yi<0) yi=0;
+                    if (yi>yiMax) yi=yiMax;
+                    taps[k].src=(xi>>8)+width*(yi>>8);
+                    taps[k].dst=k;
+                    taps[k].fx=xi&255;
+                    taps[k].fy=yi&255;
+                    rows[(yi>>8)+1]++;
+                }
+            }
+        }
+    }
+    // counting sort of the taps by the row they read
+    for (int y=0;y<height;++y) rows[y+1]+=rows[y];
+    for (int i=0;i<n;++i) {
+        answer->taps[rows[taps[i].src/width]++]=taps[i];
+    }
+    free(rows);
+    free(taps);
+    return answer;
+}
+
+/**
+ * @brief Frees a map created by newWarpCells.
+ */
+void deleteWarp(Warp * w) {
+    free(w->taps);
+    free(w);
+}
+
+/**
+ * @brief Cuts the cells of a grid out of a picture.
+ * @param w the map, built for pictures of the size of img.
+ * @param img the picture.
+ * @param out where cells*cells*size*size pixels are written.
+ */
+void warpApply(Warp * w,Img * img,unsigned char * out) {
+    if (img->width!=w->width || img->height!=w->height)
+        ERROR("map built for pictures of another size","");
+    int n=w->cells*w->cells*w->size*w->size;
+    int stride=img->width;
+    const unsigned char * data=img->data;
+    const struct warpTap * t=w->taps;
+    for (int i=0;i<n;++i,++t) {
+        const unsigned char * p=data+t->src;
+        int fx=t->fx,fy=t->fy;
+        int top=p[0]*(256-fx)+p[1]*fx;
+        int bottom=p[stride]*(256-fx)+p[stride+1]*fx;
+        out[t->dst]=(top*(256-fy)+bottom*fy+32768)>>16;
+    }
+}
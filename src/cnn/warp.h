@@ -0,0 +1,61 @@
+#ifndef WARP_H
+#define WARP_H
+
+/**
+ * @file warp.h
+ * @brief Header of the sampling maps used to cut the cells of a grid
+ *        out of a picture.
+ */
+
+#include "img.h"
+
+/**
+ * @brief One pixel of the cells: where it is read in the picture and
+ *        where it is written.
+ */
+struct warpTap {
+    /** offset of the top left pixel of the 2 by 2 pixels read */
+    int src;
+    /** offset of the pixel written in the cells */
+    int dst;
+    /** horizontal weight of the right pixels, in 1/256 */
+    unsigned char fx;
+    /** vertical weight of the bottom pixels, in 1/256 */
+    unsigned char fy;
+};
+
+/**
+ * @brief Sampling map from a picture to the cells of a grid.
+ *
+ * Taps are sorted by the row they read, so applying the map reads the
+ * picture once from top to bottom.
+ */
+struct warp {
+    /** width of the pictures the map applies to */
+    int width;
+    /** height of the pictures the map applies to */
+    int height;
+    /** number of cells on each side of the grid */
+    int cells;
+    /** number of pixels on each side of a cell */
+    int size;
+    /** cells*cells*size*size taps */
+    struct warpTap * taps;
+};
+
+/**
+ * @brief Short name for 'struct warp'
+ */
+typedef struct warp Warp;
+
+void warpHomography(const double * corners,double * m);
+Warp * newWarpCells(int width,
+                    int height,
+                    const double * corners,
+                    int cells,
+                    int size,
+                    double margin);
+void deleteWarp(Warp * w);
+void warpApply(Warp * w,Img * img,unsigned char * out);
+
+#endif